@@ -0,0 +1,58 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "arrival.h"
+
+#include <thread>
+#include <stdexcept>
+#include <cmath>
+
+using namespace std;
+
+ArrivalProcess::ArrivalProcess(double qps, bool poisson, unsigned seed)
+: qps{qps}, poisson{poisson}, rng{seed}, exponential{qps > 0 ? qps : 1.0}, next{chrono::steady_clock::now()}
+{
+    if (qps <= 0) {
+        throw runtime_error("Open-loop load needs a positive qps");
+    }
+}
+
+chrono::steady_clock::duration ArrivalProcess::gap() {
+    double seconds{poisson ? exponential(rng) : 1.0 / qps};
+    return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+}
+
+chrono::steady_clock::time_point ArrivalProcess::wait() {
+    chrono::steady_clock::time_point due{next};
+    next += gap();
+    if (due > chrono::steady_clock::now())
+        this_thread::sleep_until(due);
+    return due;
+}
+
+DelayDistribution::DelayDistribution(const string &distribution, double mean, double sigma)
+: mean{mean}, sigma{sigma}, mu{mean > 0 ? log(mean) - sigma * sigma / 2 : 0.0}
+{
+    if (distribution == "fixed") {
+        kind = Kind::Fixed;
+    } else if (distribution == "uniform") {
+        kind = Kind::Uniform;
+    } else if (distribution == "exponential") {
+        kind = Kind::Exponential;
+    } else if (distribution == "lognormal") {
+        kind = Kind::Lognormal;
+    } else {
+        throw runtime_error("Unknown delay distribution: " + distribution);
+    }
+}
@@ -0,0 +1,74 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <string>
+
+// Schedule of auction arrivals for open-loop load generation. Arrivals are
+// due at a fixed rate, either evenly spaced or as a Poisson process, no
+// matter how quickly the bidder answers.
+class ArrivalProcess {
+public:
+    ArrivalProcess(double qps, bool poisson, unsigned seed = 1);
+
+    // sleep until the next arrival is due and return when it was due. If the
+    // caller has fallen behind it returns at once, so that the schedule (and
+    // not the caller) decides the offered load.
+    std::chrono::steady_clock::time_point wait();
+
+private:
+    std::chrono::steady_clock::duration gap();
+
+    const double qps;
+    const bool poisson;
+    std::default_random_engine rng;
+    std::exponential_distribution<double> exponential;
+    std::chrono::steady_clock::time_point next;
+};
+
+// Random delays with a given mean in ms: "fixed", "uniform" (0 to twice the
+// mean), "exponential" or "lognormal" (sigma is that of the underlying normal
+// distribution)
+class DelayDistribution {
+public:
+    DelayDistribution(const std::string &distribution, double mean, double sigma = 0.5);
+
+    template <typename Rng>
+    std::chrono::steady_clock::duration draw(Rng &rng) const {
+        double ms{mean};
+        if (mean <= 0.0) {
+            return std::chrono::steady_clock::duration::zero();
+        } else if (kind == Kind::Uniform) {
+            ms = std::uniform_real_distribution<double>(0.0, 2 * mean)(rng);
+        } else if (kind == Kind::Exponential) {
+            ms = std::exponential_distribution<double>(1.0 / mean)(rng);
+        } else if (kind == Kind::Lognormal) {
+            ms = std::lognormal_distribution<double>(mu, sigma)(rng);
+        }
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(ms));
+    }
+
+private:
+    enum class Kind {
+        Fixed, Uniform, Exponential, Lognormal
+    };
+
+    Kind kind;
+    double mean;
+    double sigma;
+    double mu;      // of the underlying normal distribution, so that the mean comes out right
+};
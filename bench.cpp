@@ -0,0 +1,322 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "bench.h"
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "http_engine.h"
+#include "stats.h"
+#include "price_cipher.h"
+#include "url_template.h"
+
+using namespace std;
+
+namespace {
+
+// A minimal keep-alive HTTP responder with a thread per connection, serving
+// the same canned reply to every request. It answers in order, so pipelined
+// requests work as well.
+class Responder {
+public:
+    Responder(int listenFd, const string &body) : lfd{listenFd}, stopping{false} {
+        reply = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+                + to_string(body.length()) + "\r\n\r\n" + body;
+        acceptor = thread(&Responder::acceptLoop, this);
+    }
+
+    ~Responder() {
+        stopping = true;
+        ::shutdown(lfd, SHUT_RDWR);
+        acceptor.join();
+        ::close(lfd);
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+private:
+    void acceptLoop() {
+        while (!stopping) {
+            int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            workers.push_back(thread(&Responder::serve, this, fd));
+        }
+    }
+
+    void serve(int fd) {
+        int one{1};
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one)); // fails harmlessly on unix sockets
+        string in{};
+        string out{};
+        char buf[65536];
+        for (;;) {
+            ssize_t n = recv(fd, buf, sizeof (buf), 0);
+            if (n <= 0)
+                break;
+            in.append(buf, n);
+
+            // answer every complete request in the buffer
+            size_t used{0};
+            for (;;) {
+                size_t eoh{in.find("\r\n\r\n", used)};
+                if (eoh == string::npos)
+                    break;
+                size_t length{0};
+                size_t cl{in.find("Content-Length:", used)};
+                if (cl != string::npos && cl < eoh)
+                    length = strtoul(in.c_str() + cl + 15, nullptr, 10);
+                if (in.length() < eoh + 4 + length)
+                    break;
+                used = eoh + 4 + length;
+                out += reply;
+            }
+            in.erase(0, used);
+            if (!out.empty()) {
+                if (::send(fd, out.data(), out.length(), MSG_NOSIGNAL) < 0)
+                    break;
+                out.clear();
+            }
+        }
+        ::close(fd);
+    }
+
+    int lfd;
+    string reply;
+    atomic<bool> stopping;
+    thread acceptor;
+    vector<thread> workers;
+};
+
+int listenTcp(unsigned short &port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // any free port
+    socklen_t len{sizeof (addr)};
+    if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *> (&addr), len) < 0 || ::listen(fd, 1024) < 0
+            || getsockname(fd, reinterpret_cast<sockaddr *> (&addr), &len) < 0) {
+        throw runtime_error("Could not listen on loopback: " + string(strerror(errno)));
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+int listenUnix(const string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr{};
+    if (path.length() >= sizeof (addr.sun_path)) {
+        throw runtime_error("Unix socket path too long: " + path);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    ::unlink(path.c_str());
+    if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) < 0 || ::listen(fd, 1024) < 0) {
+        throw runtime_error("Could not listen on " + path + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// Send the requests as fast as the window of outstanding requests allows
+// and print the throughput, the latency percentiles and how many requests
+// the engine gets through per second of its reactors' CPU time
+void drive(const string &transport, const Endpoint &endpoint, const EngineOptions &options,
+        int requests, const string &body) {
+    LatencyHistogram latencies{};
+    atomic<int> failed{0};
+    const string request{buildPost("localhost", "/", body)};
+
+    HttpEngine engine{endpoint, options};
+    const auto start = chrono::steady_clock::now();
+    for (int i = 0; i < requests; ++i) {
+        engine.submit(HttpExchange{request, chrono::steady_clock::now() + chrono::seconds{10},
+            [&latencies, &failed](HttpResult & result) {
+                if (result.status == 200)
+                    latencies.record(result.latency);
+                else
+                    ++failed;
+            }});
+    }
+    engine.drain();
+    const auto elapsed = chrono::duration_cast<chrono::microseconds> (chrono::steady_clock::now() - start);
+    const chrono::microseconds cpu{engine.cpuTime()};
+
+    cout << transport << ": " << requests << " requests in " << elapsed.count() / 1000 << " ms, "
+            << static_cast<long long> (requests * 1e6 / max<long long>(elapsed.count(), 1)) << " req/s";
+    if (failed > 0)
+        cout << ", " << failed << " failed";
+    cout << endl;
+    cout << "  Latency: " << latencies.summary() << endl;
+    cout << "  Engine: " << (engine.backend() == IoBackend::Uring ? "io_uring" : "epoll") << ", " << cpu.count() / 1000
+            << " ms CPU, " << static_cast<long long> (requests * 1e6 / max<long long>(cpu.count(), 1)) << " requests per CPU second" << endl;
+}
+
+EngineOptions benchOptions(const Json::Value &configuration) {
+    EngineOptions options{};
+    options.reactors = configuration.get("reactors", 2).asInt();
+    options.connections = configuration.get("connections", 64).asInt();
+    options.outstanding = configuration.get("outstanding", 1024).asUInt();
+    options.pipeline = configuration.get("pipeline", 1).asUInt();
+    options.onTimeout = TimeoutPolicy::Abort;
+    options.linger = chrono::milliseconds{0};
+    options.io = configuration.get("io", "epoll").asString() == "uring" ? IoBackend::Uring : IoBackend::Epoll;
+    return options;
+}
+
+// Loopback TCP against a unix domain socket, with the same engine settings
+// and number of connections for both
+int transportBenchmark(const Json::Value &configuration) {
+    const Json::Value &bench = configuration["bench"];
+    const int requests{bench.get("requests", 100000).asInt()};
+    const string path{bench.get("socket", "/tmp/mockexchange-bench.sock").asString()};
+    const string body(bench.get("size", 256).asUInt(), 'x');
+    const EngineOptions options{benchOptions(configuration)};
+
+    cout << "Transport benchmark: " << options.connections << " connections, " << options.outstanding
+            << " outstanding, pipeline " << options.pipeline << ", " << body.length() << " byte bodies" << endl;
+    {
+        unsigned short port{0};
+        Responder responder{listenTcp(port), body};
+        drive("tcp", Endpoint{"127.0.0.1", port, ""}, options, requests, body);
+    }
+    {
+        Responder responder{listenUnix(path), body};
+        drive("unix", endpointFor("unix:" + path, 0), options, requests, body);
+    }
+    ::unlink(path.c_str());
+    return 0;
+}
+
+// The epoll and the io_uring engine over loopback TCP, with the same settings
+int ioBenchmark(const Json::Value &configuration) {
+    const Json::Value &bench = configuration["bench"];
+    const int requests{bench.get("requests", 100000).asInt()};
+    const string body(bench.get("size", 256).asUInt(), 'x');
+    EngineOptions options{benchOptions(configuration)};
+
+    cout << "I/O benchmark: " << options.reactors << " reactors, " << options.connections << " connections, "
+            << options.outstanding << " outstanding, pipeline " << options.pipeline << ", " << body.length() << " byte bodies" << endl;
+    for (auto io :{IoBackend::Epoll, IoBackend::Uring}) {
+        options.io = io;
+        unsigned short port{0};
+        Responder responder{listenTcp(port), body};
+        drive(io == IoBackend::Uring ? "io_uring" : "epoll", Endpoint{"127.0.0.1", port, ""}, options, requests, body);
+    }
+    return 0;
+}
+
+// seconds since start, and what each of n took in ns
+void printRate(const char *what, uint64_t n, chrono::steady_clock::time_point start) {
+    const chrono::duration<double> took = chrono::steady_clock::now() - start;
+    cout << "  " << what << ": " << static_cast<uint64_t> (n / took.count()) << " per second, "
+            << took.count() * 1e9 / n << " ns each" << endl;
+}
+
+// Encrypting prices for ${AUCTION_PRICE} with the keys absorbed into the
+// HMAC states once, against absorbing them for every price, and decrypting
+// them as a bidder would, on one thread
+int priceBenchmark(const Json::Value &configuration) {
+    const Json::Value &bench = configuration["bench"];
+    const int prices{bench.get("prices", 1000000).asInt()};
+    // the keys of "pricecipher", or made up ones of the usual 32 bytes
+    const Json::Value &cipher = configuration["pricecipher"];
+    string encryptionKey{decodeWebSafeBase64(cipher["ekey"].asString())};
+    string integrityKey{decodeWebSafeBase64(cipher["ikey"].asString())};
+    if (encryptionKey.empty())
+        encryptionKey = string(32, 'e');
+    if (integrityKey.empty())
+        integrityKey = string(32, 'i');
+
+    cout << "Price cipher benchmark: " << prices << " prices, HMAC-SHA1" << endl;
+    PriceCipher keyed{encryptionKey, integrityKey};
+    size_t length{0};
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < prices; ++i) {
+        length += keyed.encrypt(0.01 * (i % 1000 + 1)).length();
+    }
+    printRate("encrypted, keyed once", prices, start);
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < prices; ++i) {
+        PriceCipher rekeyed{encryptionKey, integrityKey};
+        length += rekeyed.encrypt(0.01 * (i % 1000 + 1)).length();
+    }
+    printRate("encrypted, keyed for each price", prices, start);
+
+    vector<string> encrypted{};
+    for (int i = 0; i < prices && i < 100000; ++i) {
+        encrypted.push_back(keyed.encrypt(0.01 * (i % 1000 + 1)));
+    }
+    uint64_t bad{0};
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < encrypted.size(); ++i) {
+        uint64_t micros{0};
+        if (!keyed.decrypt(encrypted[i], micros) || micros != static_cast<uint64_t> ((i % 1000 + 1) * 10000))
+            ++bad;
+    }
+    printRate("decrypted", encrypted.size(), start);
+    cout << "  " << bad << " of " << encrypted.size() << " did not decrypt to their price, "
+            << length / (2 * static_cast<size_t> (prices)) << " characters each" << endl;
+    return bad == 0 ? 0 : 1;
+}
+
+// Filling in a notice URL with every macro from the compiled templates
+int urlBenchmark(const Json::Value &configuration) {
+    const Json::Value &bench = configuration["bench"];
+    const int urls{bench.get("urls", 1000000).asInt()};
+    const string nurl{"http://bidder:8080/win/${AUCTION_ID}/${AUCTION_IMP_ID}/${AUCTION_PRICE}?bid=${AUCTION_BID_ID}"
+        "&seat=${AUCTION_SEAT_ID}&ad=${AUCTION_AD_ID}&cur=${AUCTION_CURRENCY}&mbr=${AUCTION_MBR}&loss=${AUCTION_LOSS}"};
+    AuctionMacros macros{"4c3e1f0a-9b2d", "1", "2", "seat", "ad", "USD", "1.234567", 2.0, 1.234567, 0};
+    cout << "URL template benchmark: " << urls << " URLs, " << nurl.length() << " characters" << endl;
+    size_t length{0};
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < urls; ++i) {
+        length += UrlTemplate::of(nurl)->target(macros).length();
+    }
+    printRate("filled in", urls, start);
+    cout << "  " << length / urls << " characters each" << endl;
+    return 0;
+}
+
+} // namespace
+
+int runBenchmark(const string &name, const Json::Value &configuration) {
+    if (name == "transport") {
+        return transportBenchmark(configuration);
+    } else if (name == "io") {
+        return ioBenchmark(configuration);
+    } else if (name == "price") {
+        return priceBenchmark(configuration);
+    } else if (name == "url") {
+        return urlBenchmark(configuration);
+    }
+    cerr << "Unknown benchmark: " << name << ". Available: transport, io, price, url" << endl;
+    return 1;
+}
@@ -0,0 +1,26 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Micro benchmarks of the exchange's own machinery, run with
+// "mockexchange bench <name> [conf.json]" and set up by the "bench" section
+// of the configuration.
+
+#pragma once
+
+#include <string>
+
+#include "json/json.h"
+
+// Run the named benchmark. Returns the process exit code.
+int runBenchmark(const std::string &name, const Json::Value &configuration);
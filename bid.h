@@ -19,6 +19,9 @@
 #include<vector>
 #include<chrono>
 #include<iostream>
+#include<cerrno>
+#include<climits>
+#include<cstdlib>
 
 #include "json/json.h"
 
@@ -40,6 +43,9 @@ struct ImpressionObject {
 	const BannerObject banner;
 	const float bidfloor;
 	//	const VideoObject video;
+	std::string logId;		// bid id and timestamp of the log line it came from, not sent
+	std::string logTime;
+	int segment{0};			// cell of the funnel model it falls in, not sent
 
 public:
 	// For banners
@@ -108,6 +114,8 @@ struct BidRequest {
         ExtObject ext;
         
 	int at;					// auction type 1 = first price auction, 2 = second price auction
+	int adexchange;				// ad exchange of the log line, requests are only coalesced within one
+	int region;				// region id of the log line
 	const std::chrono::milliseconds tmax;				// max time bidder has to reply (in ms)
 	std::vector<std::string> wseat;			// array of buyes seats allowed to bid
 
@@ -119,11 +127,11 @@ struct BidRequest {
 
 							// make an empty request
 	BidRequest()
-		: id{}, imp{}, tmax{}, app{  }, device{  }, at{}, ext{}
+		: id{}, imp{}, tmax{}, app{  }, device{  }, at{}, adexchange{}, region{}, ext{}
 	{
 	}
 	BidRequest(std::chrono::milliseconds ttmax = std::chrono::milliseconds(100))
-		: id{}, imp{}, tmax{ ttmax }, app{  }, device{  }, at{}
+		: id{}, imp{}, tmax{ ttmax }, app{  }, device{  }, at{}, adexchange{}, region{}
 	{
 	}
 
@@ -136,6 +144,7 @@ struct BidRequest {
 		Json::Value br_root;
 
 		br_root["id"] = id;
+		br_root["tmax"] = static_cast<Json::Int64> (tmax.count());
 		for (auto x : imp) {
 			Json::Value imp_inst{};
 			imp_inst["id"] = x.id;
@@ -168,7 +177,27 @@ struct BidRequest {
 };
 
 
-// read in the bid request from impression file from ipinyou data season 3
+// a number field of a log line, -1 if it is not one, for the line to be
+// rejected rather than throw
+inline int logNumber(const std::string &field)
+{
+	char *end{ nullptr };
+	errno = 0;
+	long n{ strtol(field.c_str(), &end, 10) };
+	if (end == field.c_str() || *end != '\0' || errno == ERANGE || n < 0 || n > INT_MAX)
+		return -1;
+	return static_cast<int>(n);
+}
+
+inline float logPrice(const std::string &field)
+{
+	char *end{ nullptr };
+	float price{ strtof(field.c_str(), &end) };
+	return end == field.c_str() || *end != '\0' || price < 0 ? -1 : price;
+}
+
+// read in the bid request from impression file from ipinyou data season 3.
+// Malformed numbers come out negative, see logNumber().
 std::istream& operator>>(std::istream &bids, BidRequest& br)
 {
 
@@ -178,7 +207,8 @@ std::istream& operator>>(std::istream &bids, BidRequest& br)
 	std::string brid{};			// Bid request id
 	getline(bids, brid, '\t');
 
-	getline(bids, dummy, '\t');	// skip timestamp
+	std::string timestamp{};
+	getline(bids, timestamp, '\t');	// read timestamp
 	getline(bids, dummy, '\t');	// skip log type
 	getline(bids, dummy, '\t');	// skip iPinYou id as well
 
@@ -192,14 +222,16 @@ std::istream& operator>>(std::istream &bids, BidRequest& br)
 
 	std::string region_id{};
 	getline(bids, region_id, '\t'); // read region number
-	std::string region{ region_map[stoi(region_id)] };
+	const int regionId{ logNumber(region_id) };
+	std::string region{ regionId < 0 ? "" : region_map[regionId] };
 	std::string city_id{};
 	getline(bids, city_id, '\t');   // read city id
-	std::string city{ city_map[stoi(city_id)] };
+	const int cityId{ logNumber(city_id) };
+	std::string city{ cityId < 0 ? "" : city_map[cityId] };
 
 	std::string adexId_str{};
 	getline(bids, adexId_str, '\t');	// read adexchange id
-	int adexId{ stoi(adexId_str) };
+	int adexId{ logNumber(adexId_str) };
 
 	getline(bids, dummy, '\t');	// skip domain
 	getline(bids, dummy, '\t');	// skip url
@@ -228,18 +260,22 @@ std::istream& operator>>(std::istream &bids, BidRequest& br)
 	getline(bids, dummy);		// skip rest of line
 	ws(bids);					// and get rid of some white spaces while we're at it
 
-	BannerObject bannerObj{ stoi(ad_slot_width), stoi(ad_slot_height) };
-	float bf = stof(ad_slot_floor_price) / 10;
+	BannerObject bannerObj{ logNumber(ad_slot_width), logNumber(ad_slot_height) };
+	float bf = logPrice(ad_slot_floor_price) / 10;
 	if (bf == 0) {
 		bf = 0.1;
 	}
 	ImpressionObject impObj{ "1", bannerObj,  bf};
+	impObj.logId = brid;
+	impObj.logTime = timestamp;
 	// Let's now construct a BidRequest object
 	br.id = brid;
+	br.adexchange = adexId;
+	br.region = regionId;
 	br.imp.push_back(impObj);
 	br.device = { 0, ua, ipaddr };
-	br.bidding_price = stof(bidding_price) / 10;
-	br.paying_price = stof(paying_price) / 10;
+	br.bidding_price = logPrice(bidding_price) / 10;
+	br.paying_price = logPrice(paying_price) / 10;
 
 
 	return bids;
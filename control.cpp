@@ -0,0 +1,387 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "control.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+int connectTo(const string &host, unsigned short port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res{nullptr};
+    string service{to_string(port)};
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0 || res == nullptr) {
+        throw runtime_error("Host not found: " + host + ", port: " + service);
+    }
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int listenOn(unsigned short port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw runtime_error("Could not create control socket: " + string(strerror(errno)));
+    }
+    int one{1};
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    int zero{0};
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) < 0 || ::listen(fd, 64) < 0) {
+        ::close(fd);
+        throw runtime_error("Could not listen on control port " + to_string(port) + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+Json::Value message(const string &type) {
+    Json::Value msg{};
+    msg["type"] = type;
+    return msg;
+}
+
+// Split the impression log into n ranges of about the same size, each
+// starting at the beginning of a line
+vector<streamoff> splitLog(const string &file, int n) {
+    ifstream log{file, ios::binary};
+    if (!log.good()) {
+        throw runtime_error("Could not open bids file: " + file);
+    }
+    log.seekg(0, ios::end);
+    const streamoff size{log.tellg()};
+
+    vector<streamoff> offsets{0};
+    for (int k = 1; k < n; ++k) {
+        streamoff at{size * k / n};
+        if (at < offsets.back())
+            at = offsets.back();
+        log.clear();
+        log.seekg(at);
+        string rest{};
+        if (at > 0)
+            getline(log, rest); // move on to the start of the next line
+        streamoff start{log.good() ? static_cast<streamoff> (log.tellg()) : size};
+        offsets.push_back(start);
+    }
+    offsets.push_back(size);
+    return offsets;
+}
+
+void sumCounter(Json::Value &total, const Json::Value &part, const char *name) {
+    total[name] = total[name].asUInt64() + part[name].asUInt64();
+}
+
+// Add up the latest stats of all agents and print them
+void printAggregate(const vector<Json::Value> &latest, chrono::seconds elapsed) {
+    uint64_t auctions{0};
+    LatencyHistogram auctionTimes{};
+    Json::Value bidders{Json::objectValue};
+    map<string, LatencyHistogram> serviceTimes{};
+    map<string, uint64_t> timeouts{};
+    Json::Value events{Json::objectValue};
+
+    for (auto &stats : latest) {
+        auctions += stats["auctions"].asUInt64();
+        auctionTimes.merge(stats["auctiontime"]);
+        for (auto name : stats["bidders"].getMemberNames()) {
+            const Json::Value &part = stats["bidders"][name];
+            Json::Value &total = bidders[name];
+            for (auto counter :{"replies", "bids", "wins", "failed", "dropped", "late", "retried", "reconnects", "givenup"}) {
+                sumCounter(total, part, counter);
+            }
+            serviceTimes[name].merge(part["service"]);
+        }
+        for (auto key : stats["timeouts"].getMemberNames()) {
+            timeouts[key] += stats["timeouts"][key].asUInt64();
+        }
+        for (auto counter :{"scheduled", "sent", "dropped", "depth"}) {
+            sumCounter(events, stats["events"], counter);
+        }
+        events["maxdepth"] = max(events["maxdepth"].asUInt64(), stats["events"]["maxdepth"].asUInt64());
+    }
+
+    cout << "[" << setw(4) << elapsed.count() << " s] " << latest.size() << " agents, " << auctions << " auctions";
+    if (elapsed.count() > 0)
+        cout << " (" << auctions / elapsed.count() << "/s)";
+    cout << endl;
+    cout << "  Auction time: " << auctionTimes.summary() << endl;
+    for (auto name : bidders.getMemberNames()) {
+        const Json::Value &b = bidders[name];
+        cout << "  Bidder " << name << ": " << b["replies"].asUInt64() << " replies, " << b["bids"].asUInt64() << " bids, "
+                << b["wins"].asUInt64() << " wins, " << b["failed"].asUInt64() << " failed, "
+                << b["dropped"].asUInt64() << " dropped, " << b["late"].asUInt64() << " late, "
+                << b["retried"].asUInt64() << " retried, " << b["reconnects"].asUInt64() << " reconnects" << endl;
+        cout << "    Service time: " << serviceTimes[name].summary() << endl;
+    }
+    for (auto &t : timeouts) {
+        cout << "  Timeouts for " << t.first << ": " << t.second << endl;
+    }
+    cout << "  Events: " << events["scheduled"].asUInt64() << " scheduled, " << events["sent"].asUInt64() << " sent, "
+            << events["dropped"].asUInt64() << " dropped, " << events["depth"].asUInt64() << " queued (deepest "
+            << events["maxdepth"].asUInt64() << ")" << endl;
+}
+
+} // namespace
+
+ControlChannel::ControlChannel(int fd) : sock{fd} {
+    int one{1};
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+}
+
+ControlChannel::~ControlChannel() {
+    ::close(sock);
+}
+
+void ControlChannel::send(const Json::Value &msg) {
+    Json::FastWriter writer{};
+    string line{writer.write(msg)}; // ends in a newline
+
+    lock_guard<mutex> lck(mtx);
+    size_t done{0};
+    while (done < line.length()) {
+        ssize_t n = ::send(sock, line.data() + done, line.length() - done, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("Control connection lost: " + string(strerror(errno)));
+        }
+        done += n;
+    }
+}
+
+bool ControlChannel::readSome() {
+    char buf[65536];
+    ssize_t n;
+    do {
+        n = recv(sock, buf, sizeof (buf), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    in.append(buf, n);
+    return true;
+}
+
+bool ControlChannel::next(Json::Value &msg) {
+    size_t eol{in.find('\n')};
+    if (eol == string::npos)
+        return false;
+    Json::Reader reader{};
+    bool ok{reader.parse(in.substr(0, eol), msg, false)};
+    in.erase(0, eol + 1);
+    if (!ok) {
+        throw runtime_error("Malformed control message: " + reader.getFormattedErrorMessages());
+    }
+    return true;
+}
+
+bool ControlChannel::receive(Json::Value &msg) {
+    while (!next(msg)) {
+        if (!readSome())
+            return false;
+    }
+    return true;
+}
+
+bool ControlChannel::receive(Json::Value &msg, chrono::steady_clock::time_point deadline) {
+    while (!next(msg)) {
+        const auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0)
+            return false;
+        pollfd pfd{sock, POLLIN, 0};
+        int n = poll(&pfd, 1, static_cast<int> (left));
+        if (n < 0 && errno != EINTR)
+            return false;
+        if (n > 0 && !readSome())
+            return false;
+    }
+    return true;
+}
+
+AgentLink::AgentLink(const string &host, unsigned short port) : first{0}, last{0} {
+    int fd{-1};
+    while ((fd = connectTo(host, port)) < 0) {
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+    channel.reset(new ControlChannel(fd));
+
+    char hostname[256]{};
+    gethostname(hostname, sizeof (hostname) - 1);
+    Json::Value hello{message("hello")};
+    hello["name"] = string(hostname) + ":" + to_string(getpid());
+    channel->send(hello);
+
+    Json::Value assign{};
+    if (!channel->receive(assign) || assign["type"].asString() != "assign") {
+        throw runtime_error("Expected an assignment from the controller");
+    }
+    first = static_cast<streamoff> (assign["begin"].asUInt64());
+    last = static_cast<streamoff> (assign["end"].asUInt64());
+}
+
+void AgentLink::ready() {
+    channel->send(message("ready"));
+
+    Json::Value start{};
+    if (!channel->receive(start) || start["type"].asString() != "start") {
+        throw runtime_error("Expected the start signal from the controller");
+    }
+    chrono::system_clock::time_point at{chrono::milliseconds{start["at"].asUInt64()}};
+    this_thread::sleep_until(at);
+}
+
+void AgentLink::report(const Json::Value &stats, bool done) {
+    Json::Value msg{stats};
+    msg["type"] = done ? "done" : "stats";
+    channel->send(msg);
+}
+
+int runController(const Json::Value &configuration) {
+    const Json::Value &conf = configuration["controller"];
+    const unsigned short port{static_cast<unsigned short> (conf.get("port", 7000).asInt())};
+    const int nagents{conf.get("agents", 1).asInt()};
+    const chrono::seconds report{conf.get("report", 1).asInt()};
+    const chrono::milliseconds startDelay{conf.get("startdelay", 1000).asInt()};
+    const chrono::milliseconds handshake{conf.get("handshake", 10000).asInt()};
+    if (nagents < 1) {
+        throw runtime_error("The controller needs at least one agent");
+    }
+
+    vector<streamoff> offsets{splitLog(configuration["bids"].asString(), nagents)};
+
+    int lfd{listenOn(port)};
+    cout << "Waiting for " << nagents << " agents on port " << port << endl;
+    vector<unique_ptr<ControlChannel>> agents{};
+    while (static_cast<int> (agents.size()) < nagents) {
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        unique_ptr<ControlChannel> agent{new ControlChannel(fd)};
+        // a connection that does not say hello in time is not an agent
+        Json::Value hello{};
+        if (!agent->receive(hello, chrono::steady_clock::now() + handshake) || hello["type"].asString() != "hello") {
+            cerr << "Dropped a control connection that did not say hello" << endl;
+            continue;
+        }
+        cout << "Agent " << hello["name"].asString() << " gets bytes " << offsets[agents.size()]
+                << " to " << offsets[agents.size() + 1] << endl;
+        agents.push_back(std::move(agent));
+    }
+    ::close(lfd);
+
+    for (size_t i = 0; i < agents.size(); ++i) {
+        Json::Value assign{message("assign")};
+        assign["begin"] = static_cast<Json::UInt64> (offsets[i]);
+        assign["end"] = static_cast<Json::UInt64> (offsets[i + 1]);
+        agents[i]->send(assign);
+    }
+    // the run needs every agent's share of the log, so one that does not
+    // get ready in time fails it
+    const chrono::steady_clock::time_point readyBy{chrono::steady_clock::now() + handshake};
+    for (size_t i = 0; i < agents.size(); ++i) {
+        Json::Value ready{};
+        if (!agents[i]->receive(ready, readyBy) || ready["type"].asString() != "ready") {
+            cerr << "Agent " << i << " did not get ready within " << handshake.count() << " ms" << endl;
+            return 1;
+        }
+    }
+
+    // start everybody at the same moment, a little into the future
+    chrono::system_clock::time_point startAt{chrono::system_clock::now() + startDelay};
+    Json::Value start{message("start")};
+    start["at"] = static_cast<Json::UInt64> (chrono::duration_cast<chrono::milliseconds>(startAt.time_since_epoch()).count());
+    for (auto &agent : agents) {
+        agent->send(start);
+    }
+    this_thread::sleep_until(startAt);
+
+    const chrono::steady_clock::time_point t0{chrono::steady_clock::now()};
+    chrono::steady_clock::time_point nextReport{t0 + report};
+    vector<Json::Value> latest(agents.size());
+    vector<bool> done(agents.size(), false);
+    size_t ndone{0};
+
+    while (ndone < agents.size()) {
+        vector<pollfd> fds{};
+        vector<size_t> which{};
+        for (size_t i = 0; i < agents.size(); ++i) {
+            if (!done[i]) {
+                fds.push_back(pollfd{agents[i]->fd(), POLLIN, 0});
+                which.push_back(i);
+            }
+        }
+        int wait = static_cast<int> (chrono::duration_cast<chrono::milliseconds>(nextReport - chrono::steady_clock::now()).count());
+        poll(fds.data(), fds.size(), wait > 0 ? wait : 0);
+
+        for (size_t k = 0; k < fds.size(); ++k) {
+            if (fds[k].revents == 0)
+                continue;
+            size_t i{which[k]};
+            bool alive{agents[i]->readSome()};
+            Json::Value msg{};
+            while (agents[i]->next(msg)) {
+                latest[i] = msg;
+                if (msg["type"].asString() == "done" && !done[i]) {
+                    done[i] = true;
+                    ++ndone;
+                }
+            }
+            if (!alive && !done[i]) {
+                cerr << "Lost agent " << i << ", keeping its last stats" << endl;
+                done[i] = true;
+                ++ndone;
+            }
+        }
+
+        if (chrono::steady_clock::now() >= nextReport) {
+            printAggregate(latest, chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - t0));
+            nextReport += report;
+        }
+    }
+
+    cout << "All agents are done." << endl;
+    printAggregate(latest, chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - t0));
+    return 0;
+}
@@ -0,0 +1,99 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Coordinated load generation. A controller splits the impression log into
+// line aligned byte ranges, hands one to each agent, starts all agents at
+// the same moment and aggregates the counters and latency histograms they
+// report while running. The control protocol is one JSON object per line
+// over TCP:
+//
+//   agent -> controller   {"type": "hello", "name": ...}
+//   controller -> agent   {"type": "assign", "begin": offset, "end": offset}
+//   agent -> controller   {"type": "ready"}
+//   controller -> agent   {"type": "start", "at": ms since the epoch}
+//   agent -> controller   {"type": "stats", ...}, repeatedly, and last
+//                         {"type": "done", ...} with the final stats
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <ios>
+#include <chrono>
+
+#include "json/json.h"
+
+// A control connection carrying one JSON message per line
+class ControlChannel {
+public:
+    explicit ControlChannel(int fd);
+    ~ControlChannel();
+
+    ControlChannel(const ControlChannel &) = delete;
+    ControlChannel &operator=(const ControlChannel &) = delete;
+
+    // thread safe
+    void send(const Json::Value &msg);
+
+    // block until a message arrives. Returns false if the peer has gone.
+    bool receive(Json::Value &msg);
+
+    // the same, but also returns false if no message is in by the deadline
+    bool receive(Json::Value &msg, std::chrono::steady_clock::time_point deadline);
+
+    // read what the socket has without blocking on more. Returns false if
+    // the peer has gone. Complete messages are then taken with next().
+    bool readSome();
+    bool next(Json::Value &msg);
+
+    int fd() const {
+        return sock;
+    }
+
+private:
+    int sock;
+    std::string in;
+    std::mutex mtx;
+};
+
+// The agent's end of the control connection
+class AgentLink {
+public:
+    // connect to the controller (retrying until it is up) and wait for the
+    // part of the impression log this agent is to send
+    AgentLink(const std::string &host, unsigned short port);
+
+    std::streamoff begin() const {
+        return first;
+    }
+
+    // 0 means to the end of the file
+    std::streamoff end() const {
+        return last;
+    }
+
+    // tell the controller this agent is set up and sleep until the common start
+    void ready();
+
+    void report(const Json::Value &stats, bool done);
+
+private:
+    std::unique_ptr<ControlChannel> channel;
+    std::streamoff first;
+    std::streamoff last;
+};
+
+// Run as the controller described by the "controller" section of the configuration
+int runController(const Json::Value &configuration);
@@ -0,0 +1,205 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "event_journal.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+const char magic[8]{'M', 'X', 'E', 'V', 'J', 'N', 'L', '2'};
+const size_t headerSize{4096};
+const size_t recordSize{256};
+
+enum : uint8_t {
+    Free = 0, Writing = 1, Held = 2, Spilled = 3
+};
+
+int64_t toMs(chrono::system_clock::time_point t) {
+    return chrono::duration_cast<chrono::milliseconds> (t.time_since_epoch()).count();
+}
+
+chrono::system_clock::time_point fromMs(int64_t ms) {
+    return chrono::system_clock::time_point{chrono::milliseconds{ms}};
+}
+
+} // namespace
+
+struct EventJournal::Header {
+    char magic[8];
+    uint64_t recordSize;
+    uint64_t capacity;
+};
+
+struct EventJournal::Record {
+    int64_t due;                    // ms since the epoch
+    std::atomic<uint8_t> state;     // written last, so that a record being written when the program died is told apart
+    uint8_t lengths[3];             // of the bid request id, impression id and type in data
+    uint16_t owner;                 // the sender it is spilled for
+    char data[recordSize - 14];
+};
+
+EventJournal::EventJournal(const string &path, size_t size) : fd{-1}, length{0}, header{nullptr}, records{nullptr},
+nused{0}, next{0}
+{
+    static_assert(sizeof (Record) == recordSize, "journal records have a fixed size");
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        throw runtime_error("Could not open event journal " + path + ": " + strerror(errno));
+    }
+    const bool made{st.st_size == 0};
+    if (made) {
+        const size_t capacity{max<size_t>(size / recordSize, 1)};
+        length = headerSize + capacity * recordSize;
+        if (ftruncate(fd, length) < 0) {
+            ::close(fd);
+            throw runtime_error("Could not size event journal " + path + ": " + strerror(errno));
+        }
+    } else {
+        length = static_cast<size_t> (st.st_size);
+    }
+    void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        ::close(fd);
+        throw runtime_error("Could not map event journal " + path + ": " + strerror(errno));
+    }
+    header = static_cast<Header *> (p);
+    records = reinterpret_cast<Record *> (static_cast<char *> (p) + headerSize);
+
+    if (made) {
+        // the file reads as zeros, every record is free
+        memcpy(header->magic, magic, sizeof (magic));
+        header->recordSize = recordSize;
+        header->capacity = (length - headerSize) / recordSize;
+    } else if (length < headerSize || memcmp(header->magic, magic, sizeof (magic)) != 0 || header->recordSize != recordSize
+            || headerSize + header->capacity * recordSize > length) {
+        munmap(p, length);
+        ::close(fd);
+        throw runtime_error("Not an event journal: " + path);
+    }
+
+    // records that were being written when an earlier run stopped are lost
+    for (uint64_t pos = 0; pos < header->capacity; ++pos) {
+        Record &r = at(pos);
+        if (r.state == Writing)
+            r.state = Free;
+        else if (r.state != Free)
+            ++nused;
+    }
+}
+
+EventJournal::~EventJournal() {
+    munmap(header, length);
+    ::close(fd);
+}
+
+EventJournal::Record &EventJournal::at(uint64_t pos) const {
+    return records[pos];
+}
+
+size_t EventJournal::capacity() const {
+    return header->capacity;
+}
+
+size_t EventJournal::used() const {
+    return nused.load();
+}
+
+bool EventJournal::fits(const string &bidRequestId, const string &impId, const string &type) const {
+    return bidRequestId.length() <= UINT8_MAX && impId.length() <= UINT8_MAX && type.length() <= UINT8_MAX
+            && bidRequestId.length() + impId.length() + type.length() <= sizeof (Record::data);
+}
+
+uint64_t EventJournal::append(chrono::system_clock::time_point due, const string &bidRequestId, const string &impId,
+        const string &type, unsigned owner) {
+    // take a record before looking for it, so that there is always a free one to find
+    if (nused.fetch_add(1) >= header->capacity) {
+        --nused;
+        return none;
+    }
+    uint64_t pos{next.fetch_add(1) % header->capacity};
+    for (;;) {
+        uint8_t expected{Free};
+        if (at(pos).state.compare_exchange_weak(expected, Writing))
+            break;
+        pos = (pos + 1) % header->capacity;
+    }
+    next.store(pos + 1, memory_order_relaxed);
+
+    Record &r = at(pos);
+    r.due = toMs(due);
+    r.lengths[0] = static_cast<uint8_t> (bidRequestId.length());
+    r.lengths[1] = static_cast<uint8_t> (impId.length());
+    r.lengths[2] = static_cast<uint8_t> (type.length());
+    r.owner = static_cast<uint16_t> (owner);
+    char *p{r.data};
+    for (const string *s :{&bidRequestId, &impId, &type}) {
+        memcpy(p, s->data(), s->length());
+        p += s->length();
+    }
+    r.state.store(Held, memory_order_release);
+    return pos;
+}
+
+void EventJournal::read(uint64_t pos, string &bidRequestId, string &impId, string &type) const {
+    const Record &r = at(pos);
+    const char *p{r.data};
+    bidRequestId.assign(p, r.lengths[0]);
+    p += r.lengths[0];
+    impId.assign(p, r.lengths[1]);
+    p += r.lengths[1];
+    type.assign(p, r.lengths[2]);
+}
+
+void EventJournal::spill(uint64_t pos, unsigned owner) {
+    Record &r = at(pos);
+    r.owner = static_cast<uint16_t> (owner);
+    r.state.store(Spilled, memory_order_release);
+}
+
+void EventJournal::spilled(unsigned owner, function<void(uint64_t, chrono::system_clock::time_point)> f) const {
+    for (uint64_t pos = 0; pos < header->capacity; ++pos) {
+        const Record &r = at(pos);
+        if (r.state.load(memory_order_acquire) == Spilled && r.owner == owner)
+            f(pos, fromMs(r.due));
+    }
+}
+
+void EventJournal::recall(uint64_t pos) {
+    at(pos).state.store(Held, memory_order_release);
+}
+
+void EventJournal::done(uint64_t pos) {
+    at(pos).state.store(Free, memory_order_release);
+    --nused;
+}
+
+void EventJournal::pending(function<void(uint64_t, chrono::system_clock::time_point)> f) const {
+    for (uint64_t pos = 0; pos < header->capacity; ++pos) {
+        const Record &r = at(pos);
+        const uint8_t state{r.state.load(memory_order_acquire)};
+        if (state == Held || state == Spilled)
+            f(pos, fromMs(r.due));
+    }
+}
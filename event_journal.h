@@ -0,0 +1,90 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Journal of the scheduled events, in a file mapped into memory. Every event
+// takes one of a fixed number of fixed-size records while it waits, and
+// gives it back as soon as it has been sent, in whatever order that happens,
+// so an event due far ahead holds up only its own record. The number of
+// records is fixed when the file is made, which bounds the disk the events
+// take, and the kernel writes the pages back to the file as it needs the
+// memory. A record is either held, its event also waiting in memory, or
+// spilled, its event waiting only here until its sender recalls it. Events
+// still unsent when the program stops, or dies, are found again when the
+// journal is next opened. Appending, spilling and marking take no lock.
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+class EventJournal {
+public:
+    static const uint64_t none = ~0ULL;
+
+    // Open the journal at path, or make one of about size bytes if there is
+    // none. An existing journal keeps the size it was made with.
+    EventJournal(const std::string &path, size_t size);
+    ~EventJournal();
+
+    EventJournal(const EventJournal &) = delete;
+    EventJournal &operator=(const EventJournal &) = delete;
+
+    // whether the event is small enough for a record
+    bool fits(const std::string &bidRequestId, const std::string &impId, const std::string &type) const;
+
+    // Record an event due at due for sender owner (any thread), held. Returns
+    // its position, or none if every record is taken.
+    uint64_t append(std::chrono::system_clock::time_point due, const std::string &bidRequestId,
+            const std::string &impId, const std::string &type, unsigned owner);
+
+    // the ids and type of the event at pos
+    void read(uint64_t pos, std::string &bidRequestId, std::string &impId, std::string &type) const;
+
+    // the event at pos is no longer in memory, it waits here for owner
+    void spill(uint64_t pos, unsigned owner);
+
+    // call f with the position and due time of every event spilled for owner
+    void spilled(unsigned owner, std::function<void(uint64_t, std::chrono::system_clock::time_point)> f) const;
+
+    // the event at pos is held in memory again
+    void recall(uint64_t pos);
+
+    // the event at pos has been sent, or given up, and its record is free (any thread)
+    void done(uint64_t pos);
+
+    // call f with the position and due time of every event not sent yet, for
+    // picking up where an earlier run left off
+    void pending(std::function<void(uint64_t, std::chrono::system_clock::time_point)> f) const;
+
+    size_t capacity() const;
+
+    // records taken by events not sent yet
+    size_t used() const;
+
+private:
+    struct Header;
+    struct Record;
+
+    Record &at(uint64_t pos) const;
+
+    int fd;
+    size_t length;
+    Header *header;
+    Record *records;
+    std::atomic<uint64_t> nused;
+    std::atomic<uint64_t> next;     // where the next append starts looking for a free record
+};
@@ -0,0 +1,247 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "event_scheduler.h"
+
+#include <random>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// events a sender moves from its queue into memory before it looks for due ones
+const size_t drainBatch{256};
+
+const chrono::steady_clock::rep awake{0};
+
+} // namespace
+
+EventScheduler::EventScheduler(int senders, size_t queue, size_t memory, function<void(const ScheduledEvent &)> send,
+        unique_ptr<EventJournal> journal)
+: send(std::move(send)), log(std::move(journal)), held{max<size_t>(memory / max(senders, 1), 1)},
+steadyStart{chrono::steady_clock::now()}, wallStart{chrono::system_clock::now()}, stopping{false}, nscheduled{0},
+nsent{0}, ndropped{0}, nreplayed{0}, nspilled{0}, noverflowed{0}, maxdepth{0}
+{
+    for (int i = 0; i < max(senders, 1); ++i) {
+        this->senders.emplace_back(new Sender(static_cast<unsigned> (i), queue));
+    }
+
+    // what an earlier run left goes straight to the senders, before they
+    // start, whatever the size of the queues
+    if (log) {
+        size_t turn{0};
+        log->pending([&](uint64_t pos, chrono::system_clock::time_point due) {
+            const auto at = max(steadyOf(due), chrono::steady_clock::now());
+            // spilled for whichever sender it was, until admit() says otherwise
+            log->recall(pos);
+            admit(*this->senders[turn++ % this->senders.size()], ScheduledEvent{at, "", "", "", pos});
+            ++nscheduled;
+            ++nreplayed;
+        });
+    }
+    for (auto &s : this->senders) {
+        s->thread = thread(&EventScheduler::senderLoop, this, std::ref(*s));
+    }
+}
+
+EventScheduler::~EventScheduler() {
+    stop();
+}
+
+void EventScheduler::schedule(const DelayDistribution &delay, const string &bidRequestId, const string &impId,
+        const string &type) {
+    // every producer draws from its own generator
+    static thread_local mt19937_64 rng{random_device{}()};
+    schedule(delay.draw(rng), bidRequestId, impId, type);
+}
+
+void EventScheduler::schedule(chrono::steady_clock::duration delay, const string &bidRequestId, const string &impId,
+        const string &type) {
+    // and deals its events out to the senders in turn
+    static thread_local size_t turn{0};
+    Sender &s = *senders[turn++ % senders.size()];
+
+    const auto at = chrono::steady_clock::now() + delay;
+    uint64_t pos{EventJournal::none};
+    if (log && log->fits(bidRequestId, impId, type)) {
+        // journalled events wait with nothing but their due time in memory;
+        // with every record taken the event is kept whole, and dropped if
+        // its sender has to spill it
+        pos = log->append(wallOf(at), bidRequestId, impId, type, s.index);
+    }
+    ScheduledEvent ev{pos == EventJournal::none ? ScheduledEvent{at, bidRequestId, impId, type, pos}
+        : ScheduledEvent{at, "", "", "", pos}};
+    const chrono::steady_clock::rep due{ev.due.time_since_epoch().count()};
+    ++nscheduled;
+    if (!s.inbox.tryPush(std::move(ev))) {
+        --nscheduled;
+        ++ndropped;
+        if (pos != EventJournal::none)
+            log->done(pos);
+        return;
+    }
+
+    // wake the sender if it sleeps past the new event, or if its queue is
+    // filling up while it sleeps until an earlier one. An awake sender drains
+    // its queue before it sleeps again.
+    atomic_thread_fence(memory_order_seq_cst);
+    const chrono::steady_clock::rep wakeAt{s.wakeAt.load()};
+    if (wakeAt != awake && (due < wakeAt || s.inbox.depth() >= s.inbox.capacity() / 2)) {
+        lock_guard<mutex> lck(s.mtx);
+        s.cv.notify_one();
+    }
+}
+
+// The journal keeps wall clock times, for a later run. They are converted
+// with the two clocks as they were when the scheduler started, so that the
+// order of the events does not depend on when they are converted.
+chrono::steady_clock::time_point EventScheduler::steadyOf(chrono::system_clock::time_point due) const {
+    return steadyStart + chrono::duration_cast<chrono::steady_clock::duration> (due - wallStart);
+}
+
+chrono::system_clock::time_point EventScheduler::wallOf(chrono::steady_clock::time_point due) const {
+    return wallStart + chrono::duration_cast<chrono::system_clock::duration> (due - steadyStart);
+}
+
+// Take an event into the sender's memory, or spill it, or the one due last,
+// if that would go over the budget or put it after a spilled one.
+void EventScheduler::admit(Sender &s, ScheduledEvent &&ev) {
+    if (s.spilled > 0 && ev.due >= s.spillFloor) {
+        spill(s, std::move(ev));
+        return;
+    }
+    if (s.waiting.size() >= held) {
+        auto last = prev(s.waiting.end());
+        if (ev.due >= last->first) {
+            spill(s, std::move(ev));
+            return;
+        }
+        ScheduledEvent out{std::move(last->second)};
+        s.waiting.erase(last);
+        spill(s, std::move(out));
+    }
+    const auto due = ev.due;
+    s.waiting.emplace(due, std::move(ev));
+}
+
+// leave the event to wait in the journal, writing it there if it is not yet
+void EventScheduler::spill(Sender &s, ScheduledEvent &&ev) {
+    uint64_t pos{ev.journalPos};
+    if (pos == EventJournal::none && log && log->fits(ev.bidRequestId, ev.impId, ev.type))
+        pos = log->append(wallOf(ev.due), ev.bidRequestId, ev.impId, ev.type, s.index);
+    if (pos == EventJournal::none) {
+        --nscheduled;
+        ++noverflowed;
+        return;
+    }
+    log->spill(pos, s.index);
+    if (s.spilled == 0 || ev.due < s.spillFloor)
+        s.spillFloor = ev.due;
+    ++s.spilled;
+    ++nspilled;
+}
+
+// Take back the sender's spilled events due first, up to half its budget so
+// that there is room left for those scheduled meanwhile. One pass over the
+// journal serves that many events.
+void EventScheduler::recall(Sender &s) {
+    vector<pair<chrono::steady_clock::time_point, uint64_t>> found{};
+    log->spilled(s.index, [this, &found](uint64_t pos, chrono::system_clock::time_point due) {
+        found.emplace_back(steadyOf(due), pos);
+    });
+    const size_t n{min(found.size(), max<size_t>(held / 2, 1))};
+    nth_element(found.begin(), found.begin() + n, found.end());
+    for (size_t i = 0; i < n; ++i) {
+        log->recall(found[i].second);
+        s.waiting.emplace(found[i].first, ScheduledEvent{found[i].first, "", "", "", found[i].second});
+    }
+    s.spilled = found.size() - n;
+    if (s.spilled > 0)
+        s.spillFloor = min_element(found.begin() + n, found.end())->first;
+}
+
+void EventScheduler::stop() {
+    stopping = true;
+    for (auto &s : senders) {
+        {
+            lock_guard<mutex> lck(s->mtx);
+        }
+        s->cv.notify_one();
+    }
+    for (auto &s : senders) {
+        if (s->thread.joinable())
+            s->thread.join();
+    }
+}
+
+size_t EventScheduler::depth() const {
+    size_t n{0};
+    for (auto &s : senders) {
+        n += s->inbox.depth();
+    }
+    return n;
+}
+
+void EventScheduler::senderLoop(Sender &s) {
+    for (;;) {
+        const size_t d{s.inbox.depth()};
+        size_t seen{maxdepth.load()};
+        while (d > seen && !maxdepth.compare_exchange_weak(seen, d)) {
+        }
+        s.inbox.drain([this, &s](ScheduledEvent && ev) {
+            admit(s, std::move(ev));
+        }, drainBatch);
+        if (stopping)
+            return;
+
+        bool sentAny{false};
+        for (;;) {
+            if (s.waiting.empty() && s.spilled > 0)
+                recall(s);
+            if (s.waiting.empty())
+                break;
+            const auto first = s.waiting.begin();
+            const auto now = chrono::steady_clock::now();
+            if (first->first > now)
+                break;
+            late.record(chrono::duration_cast<chrono::microseconds> (now - first->first));
+            ScheduledEvent ev{std::move(first->second)};
+            s.waiting.erase(first);
+            if (ev.journalPos != EventJournal::none)
+                log->read(ev.journalPos, ev.bidRequestId, ev.impId, ev.type);
+            send(ev);
+            if (ev.journalPos != EventJournal::none)
+                log->done(ev.journalPos);
+            ++nsent;
+            sentAny = true;
+        }
+        if (sentAny || !s.inbox.empty())
+            continue;
+
+        unique_lock<mutex> lck(s.mtx);
+        const chrono::steady_clock::rep wakeAt{s.waiting.empty() ? numeric_limits<chrono::steady_clock::rep>::max()
+            : s.waiting.begin()->first.time_since_epoch().count()};
+        s.wakeAt.store(wakeAt);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (s.inbox.empty() && !stopping) {
+            if (s.waiting.empty())
+                s.cv.wait(lck);
+            else
+                s.cv.wait_until(lck, s.waiting.begin()->first);
+        }
+        s.wakeAt.store(awake);
+    }
+}
@@ -0,0 +1,173 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Scheduling of the events that follow a win, such as clicks and
+// conversions. Each event is given its own due time, drawn from a delay
+// distribution when it is scheduled. Every sender thread keeps its events in
+// order of that time and sends them as they fall due, so that a slow send
+// holds up only its own thread. Events are handed to the senders, in turn,
+// through bounded lock-free queues that each sender drains in batches:
+// scheduling never takes a lock, and an event that finds its sender's queue
+// full is dropped and counted. A sender keeps at most its share of a fixed
+// number of events in memory. With a journal the events are also written to
+// disk as they are scheduled, those beyond the memory budget wait only there,
+// always the ones due last, and are taken back as the sender runs short; the
+// events an earlier run left unsent are scheduled again. An event that finds
+// both memory and the journal full, or memory full and no journal, is
+// dropped and counted.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+
+#include "arrival.h"
+#include "mpsc_queue.h"
+#include "event_journal.h"
+#include "stats.h"
+
+struct ScheduledEvent {
+    std::chrono::steady_clock::time_point due;
+    std::string bidRequestId;
+    std::string impId;
+    std::string type;   // CLICK or CONVERSION
+    uint64_t journalPos;    // EventJournal::none if not journalled, else the ids and type are read from the journal when due
+};
+
+class EventScheduler {
+public:
+    // send is called on one of the sender threads for every event that falls
+    // due. queue is the number of events each sender may have waiting to be
+    // taken, memory the number of events the senders keep in memory between
+    // them. A journal is owned by the scheduler.
+    EventScheduler(int senders, size_t queue, size_t memory, std::function<void(const ScheduledEvent &)> send,
+            std::unique_ptr<EventJournal> journal = nullptr);
+
+    // stops the senders, see stop()
+    ~EventScheduler();
+
+    EventScheduler(const EventScheduler &) = delete;
+    EventScheduler &operator=(const EventScheduler &) = delete;
+
+    // enter an event due after a delay drawn from delay (any thread)
+    void schedule(const DelayDistribution &delay, const std::string &bidRequestId, const std::string &impId,
+            const std::string &type);
+
+    // enter an event due after delay (any thread)
+    void schedule(std::chrono::steady_clock::duration delay, const std::string &bidRequestId, const std::string &impId,
+            const std::string &type);
+
+    // let the senders finish the events they are sending and join them. The
+    // events not yet due are left unsent.
+    void stop();
+
+    uint64_t scheduled() const {
+        return nscheduled.load();
+    }
+
+    uint64_t sent() const {
+        return nsent.load();
+    }
+
+    // scheduled and not sent yet
+    uint64_t pending() const {
+        return nscheduled.load() - nsent.load();
+    }
+
+    // picked up from the journal of an earlier run
+    uint64_t replayed() const {
+        return nreplayed.load();
+    }
+
+    // the sender's queue was full
+    uint64_t dropped() const {
+        return ndropped.load();
+    }
+
+    // left to wait in the journal alone because memory was full
+    uint64_t spilled() const {
+        return nspilled.load();
+    }
+
+    // dropped because memory was full and the journal too, or there was none
+    uint64_t overflowed() const {
+        return noverflowed.load();
+    }
+
+    // events in the senders' queues, not yet taken
+    size_t depth() const;
+
+    // the most events a sender has found in its queue at once
+    size_t maxDepth() const {
+        return maxdepth.load();
+    }
+
+    // from an event being due until a sender took it
+    const LatencyHistogram &lateness() const {
+        return late;
+    }
+
+    // null without one
+    const EventJournal *journal() const {
+        return log.get();
+    }
+
+private:
+    struct Sender {
+        Sender(unsigned index, size_t queue) : index{index}, inbox(queue), spilled{0}, wakeAt{0} {
+        }
+
+        const unsigned index;
+        MpscQueue<ScheduledEvent> inbox;
+        // the sender's own, all due no later than any of its spilled ones
+        std::multimap<std::chrono::steady_clock::time_point, ScheduledEvent> waiting;
+        size_t spilled;                 // in the journal only
+        std::chrono::steady_clock::time_point spillFloor;  // when the first of those is due
+        std::atomic<std::chrono::steady_clock::rep> wakeAt;    // when it sleeps until, 0 while it is awake
+        std::mutex mtx;                 // only to sleep on cv
+        std::condition_variable cv;
+        std::thread thread;
+    };
+
+    void senderLoop(Sender &s);
+    void admit(Sender &s, ScheduledEvent &&ev);
+    void spill(Sender &s, ScheduledEvent &&ev);
+    void recall(Sender &s);
+    std::chrono::steady_clock::time_point steadyOf(std::chrono::system_clock::time_point due) const;
+    std::chrono::system_clock::time_point wallOf(std::chrono::steady_clock::time_point due) const;
+
+    const std::function<void(const ScheduledEvent &)> send;
+    const std::unique_ptr<EventJournal> log;
+    std::vector<std::unique_ptr<Sender>> senders;
+    const size_t held;          // events each sender may keep in memory
+    const std::chrono::steady_clock::time_point steadyStart;
+    const std::chrono::system_clock::time_point wallStart;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> nscheduled;
+    std::atomic<uint64_t> nsent;
+    std::atomic<uint64_t> ndropped;
+    std::atomic<uint64_t> nreplayed;
+    std::atomic<uint64_t> nspilled;
+    std::atomic<uint64_t> noverflowed;
+    std::atomic<size_t> maxdepth;
+    LatencyHistogram late;
+};
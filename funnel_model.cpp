@@ -0,0 +1,126 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "funnel_model.h"
+
+#include <stdexcept>
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+
+const vector<string> uaClasses{"desktop", "mobile", "tablet"};
+
+uint64_t threshold(double p) {
+    if (p < 0.0 || p > 1.0) {
+        throw runtime_error("Funnel rates must be between 0 and 1");
+    }
+    return p >= 1.0 ? UINT64_MAX : static_cast<uint64_t> (p * 18446744073709551616.0);
+}
+
+int64_t slotKey(int width, int height) {
+    return static_cast<int64_t> (width) << 32 | static_cast<uint32_t> (height);
+}
+
+int64_t uaKey(const string &uaClass) {
+    for (size_t i = 0; i < uaClasses.size(); ++i) {
+        if (uaClasses[i] == uaClass)
+            return i;
+    }
+    throw runtime_error("Unknown user agent class: " + uaClass);
+}
+
+// one segment of the configuration, with the codes of the values it names
+// (0 for any)
+struct Segment {
+    int slot;
+    int region;
+    int adexchange;
+    int ua;
+    const Json::Value *conf;
+};
+
+int codeFor(unordered_map<int64_t, int> &codes, int64_t value) {
+    auto it = codes.find(value);
+    if (it != codes.end())
+        return it->second;
+    const int code{static_cast<int> (codes.size()) + 1};
+    codes[value] = code;
+    return code;
+}
+
+} // namespace
+
+FunnelModel::FunnelModel(const Json::Value &conf) : rngSeed{conf.get("seed", 1).asUInt64()} {
+    vector<Segment> segments{};
+    for (auto &s : conf["segments"]) {
+        Segment seg{0, 0, 0, 0, &s};
+        if (s.isMember("slot")) {
+            int w{0}, h{0};
+            if (sscanf(s["slot"].asCString(), "%dx%d", &w, &h) != 2) {
+                throw runtime_error("Funnel slot is not WxH: " + s["slot"].asString());
+            }
+            seg.slot = codeFor(slots, slotKey(w, h));
+        }
+        if (s.isMember("region"))
+            seg.region = codeFor(regions, s["region"].asInt());
+        if (s.isMember("adex"))
+            seg.adexchange = codeFor(adexchanges, s["adex"].asInt());
+        if (s.isMember("ua"))
+            seg.ua = codeFor(uas, uaKey(s["ua"].asString()));
+        segments.push_back(seg);
+    }
+
+    // every combination of the codes, in the order cellOf counts them
+    const Rates base{threshold(conf.get("ctr", 0.2).asDouble()), threshold(conf.get("cvr", 0.0).asDouble())};
+    table.assign((slots.size() + 1) * (regions.size() + 1) * (adexchanges.size() + 1) * (uas.size() + 1), base);
+    size_t cell{0};
+    for (size_t s = 0; s <= slots.size(); ++s) {
+        for (size_t r = 0; r <= regions.size(); ++r) {
+            for (size_t a = 0; a <= adexchanges.size(); ++a) {
+                for (size_t u = 0; u <= uas.size(); ++u, ++cell) {
+                    for (auto &seg : segments) {
+                        if ((seg.slot && seg.slot != static_cast<int> (s)) || (seg.region && seg.region != static_cast<int> (r))
+                                || (seg.adexchange && seg.adexchange != static_cast<int> (a)) || (seg.ua && seg.ua != static_cast<int> (u)))
+                            continue;
+                        if (seg.conf->isMember("ctr"))
+                            table[cell].click = threshold((*seg.conf)["ctr"].asDouble());
+                        if (seg.conf->isMember("cvr"))
+                            table[cell].conversion = threshold((*seg.conf)["cvr"].asDouble());
+                    }
+                }
+            }
+        }
+    }
+}
+
+int FunnelModel::cellOf(int width, int height, int region, int adexchange, const string &ua) const {
+    const int s{codeOf(slots, slotKey(width, height))};
+    const int r{codeOf(regions, region)};
+    const int a{codeOf(adexchanges, adexchange)};
+    const int u{uas.empty() ? 0 : codeOf(uas, uaKey(uaClass(ua)))};
+    return ((s * static_cast<int> (regions.size() + 1) + r) * static_cast<int> (adexchanges.size() + 1) + a)
+            * static_cast<int> (uas.size() + 1) + u;
+}
+
+string FunnelModel::uaClass(const string &ua) {
+    if (ua.find("iPad") != string::npos || ua.find("Tablet") != string::npos) {
+        return "tablet";
+    } else if (ua.find("Mobile") != string::npos || ua.find("Android") != string::npos
+            || ua.find("iPhone") != string::npos || ua.find("Windows Phone") != string::npos) {
+        return "mobile";
+    }
+    return "desktop";
+}
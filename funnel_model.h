@@ -0,0 +1,118 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Model of how often a won impression is clicked (CTR) and a click converts
+// (CVR), by segment: ad slot size, region, ad exchange and user agent class.
+// The segments in the configuration are compiled into a table with a cell
+// for every combination of the values they name, so looking up the rates of
+// an impression takes a few hash lookups and no search through the rules.
+// The decisions are drawn from a counter-based generator keyed on the log
+// line, so a run makes the same ones whichever thread handles a win.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "json/json.h"
+
+// Random numbers that are a function of a key and a counter, for drawing
+// the same values for the same event in any thread and in any order. The
+// mixing is that of SplitMix64.
+class CounterRng {
+public:
+    typedef uint64_t result_type;
+
+    CounterRng(uint64_t seed, const std::string &key) : base{seed ^ 14695981039346656037ULL}, counter{0} {
+        // FNV-1a of the key, on top of the seed
+        for (unsigned char c : key) {
+            base = (base ^ c) * 1099511628211ULL;
+        }
+    }
+
+    result_type operator()() {
+        uint64_t z{base + ++counter * 0x9E3779B97F4A7C15ULL};
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return UINT64_MAX;
+    }
+
+private:
+    uint64_t base;
+    uint64_t counter;
+};
+
+class FunnelModel {
+public:
+    // from "funnel": {"ctr": p, "cvr": p, "seed": n, "segments": [{"slot":
+    // "300x250", "region": id, "adex": id, "ua": "mobile", "ctr": p, "cvr": p},
+    // ...]}. A segment sets the rates it names for the impressions that match
+    // all of its other keys, later segments over earlier ones.
+    explicit FunnelModel(const Json::Value &conf);
+
+    // the table cell of an impression
+    int cellOf(int width, int height, int region, int adexchange, const std::string &ua) const;
+
+    // whether a won impression in cell is clicked, and whether that click
+    // converts, keyed on the log line it came from
+    bool clicked(int cell, CounterRng &rng) const {
+        return rng() < table[cell].click;
+    }
+
+    bool converted(int cell, CounterRng &rng) const {
+        return rng() < table[cell].conversion;
+    }
+
+    uint64_t seed() const {
+        return rngSeed;
+    }
+
+    size_t cells() const {
+        return table.size();
+    }
+
+    // desktop, mobile or tablet
+    static std::string uaClass(const std::string &ua);
+
+private:
+    struct Rates {
+        uint64_t click;         // of 2^64
+        uint64_t conversion;
+    };
+
+    // value of one dimension to its code, 0 for any value no segment names
+    typedef std::unordered_map<int64_t, int> Codes;
+
+    static int codeOf(const Codes &codes, int64_t value) {
+        auto it = codes.find(value);
+        return it == codes.end() ? 0 : it->second;
+    }
+
+    Codes slots;
+    Codes regions;
+    Codes adexchanges;
+    Codes uas;
+    std::vector<Rates> table;
+    uint64_t rngSeed;
+};
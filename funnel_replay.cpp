@@ -0,0 +1,170 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "funnel_replay.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+namespace {
+
+// days since 1970-01-01 of a date in the proleptic Gregorian calendar
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era{(y >= 0 ? y : y - 399) / 400};
+    const unsigned yoe{static_cast<unsigned> (y - era * 400)};
+    const unsigned doy{(153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1};
+    const unsigned doe{yoe * 365 + yoe / 4 - yoe / 100 + doy};
+    return era * 146097 + static_cast<int64_t> (doe) - 719468;
+}
+
+} // namespace
+
+int64_t parseLogTime(const string &timestamp) {
+    if (timestamp.length() != 17 || !all_of(timestamp.begin(), timestamp.end(), [](char c) {
+            return isdigit(static_cast<unsigned char> (c));
+        })) {
+        return -1;
+    }
+    auto field = [&timestamp](size_t pos, size_t len) {
+        return static_cast<unsigned> (stoul(timestamp.substr(pos, len)));
+    };
+    const int64_t days{daysFromCivil(field(0, 4), field(4, 2), field(6, 2))};
+    return (((days * 24 + field(8, 2)) * 60 + field(10, 2)) * 60 + field(12, 2)) * 1000 + field(14, 3);
+}
+
+FunnelReplay::Side::Side(const vector<string> &files, const string &type)
+: files(files), type(type), nextFile{0}, peeked{false}, peekAt{0}
+{
+    for (auto &f : files) {
+        if (!ifstream{f}.good()) {
+            throw runtime_error("Could not open " + type + " log: " + f);
+        }
+    }
+}
+
+// the next line of the logs with a timestamp, left in peekId and peekAt
+bool FunnelReplay::Side::peek() {
+    string line{};
+    while (!peeked) {
+        if (!log.is_open() || !getline(log, line)) {
+            if (nextFile >= files.size())
+                return false;
+            log.close();
+            log.clear();
+            log.open(files[nextFile++]);
+            continue;
+        }
+        const size_t tab{line.find('\t')};
+        if (tab == string::npos)
+            continue;
+        const size_t end{line.find('\t', tab + 1)};
+        const int64_t at{parseLogTime(line.substr(tab + 1, end == string::npos ? string::npos : end - tab - 1))};
+        if (at < 0)
+            continue; // a header or a broken line
+        peekId = line.substr(0, tab);
+        peekAt = at;
+        peeked = true;
+    }
+    return true;
+}
+
+void FunnelReplay::Side::readUntil(int64_t until) {
+    while (peek() && peekAt <= until) {
+        byId[peekId].push_back(peekAt);
+        order.emplace_back(peekAt, std::move(peekId));
+        peeked = false;
+    }
+}
+
+void FunnelReplay::Side::expire(int64_t since) {
+    while (!order.empty() && order.front().first < since) {
+        auto it = byId.find(order.front().second);
+        if (it != byId.end()) {
+            auto &times = it->second;
+            auto t = find(times.begin(), times.end(), order.front().first);
+            if (t != times.end()) {
+                times.erase(t);
+                ++expired;
+            }
+            if (times.empty())
+                byId.erase(it);
+        }
+        order.pop_front();
+    }
+}
+
+void FunnelReplay::Side::take(const string &bidId, int64_t at, int64_t until, vector<FunnelEvent> &out) {
+    auto it = byId.find(bidId);
+    if (it == byId.end())
+        return;
+    auto &times = it->second;
+    for (size_t i = 0; i < times.size();) {
+        if (times[i] >= at && times[i] <= until) {
+            out.push_back(FunnelEvent{type, chrono::milliseconds{times[i] - at}});
+            ++joined;
+            times[i] = times.back();
+            times.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    if (times.empty())
+        byId.erase(it);
+}
+
+FunnelReplay::FunnelReplay(const vector<string> &clicks, const vector<string> &conversions, chrono::milliseconds window)
+: window{window.count()}, clickLog(clicks, "CLICK"), conversionLog(conversions, "CONVERSION"), latest{0}, maxheld{0}
+{
+}
+
+vector<FunnelEvent> FunnelReplay::match(const string &bidId, const string &timestamp) {
+    vector<FunnelEvent> found{};
+    const int64_t at{parseLogTime(timestamp)};
+    if (at < 0)
+        return found;
+
+    lock_guard<mutex> lck(mtx);
+    latest = max(latest, at);
+    for (Side *side :{&clickLog, &conversionLog}) {
+        side->readUntil(latest + window);
+        side->expire(latest - window);
+        side->take(bidId, at, at + window, found);
+    }
+    maxheld = max(maxheld, clickLog.held() + conversionLog.held());
+    return found;
+}
+
+uint64_t FunnelReplay::clicks() {
+    lock_guard<mutex> lck(mtx);
+    return clickLog.joined;
+}
+
+uint64_t FunnelReplay::conversions() {
+    lock_guard<mutex> lck(mtx);
+    return conversionLog.joined;
+}
+
+uint64_t FunnelReplay::expired() {
+    lock_guard<mutex> lck(mtx);
+    return clickLog.expired + conversionLog.expired;
+}
+
+size_t FunnelReplay::maxHeld() {
+    lock_guard<mutex> lck(mtx);
+    return maxheld;
+}
@@ -0,0 +1,108 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Replay of the clicks and conversions in iPinYou click (clk.*.txt) and
+// conversion (conv.*.txt) logs. The logs are read as the impression log is
+// replayed and joined by bid id against the impressions that win: the log
+// lines are held in a hash table on bid id for as long as an impression they
+// may belong to can still win, which is a window of log time on either side
+// of the latest won impression, so memory is bounded by the window and not
+// by the size of the logs. A joined click or conversion is to be sent as far
+// after the win as it was logged after its impression.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+struct FunnelEvent {
+    std::string type;                   // CLICK or CONVERSION
+    std::chrono::milliseconds offset;   // after the impression, in the logs
+};
+
+class FunnelReplay {
+public:
+    // the click and conversion logs, each a list of files in time order
+    FunnelReplay(const std::vector<std::string> &clicks, const std::vector<std::string> &conversions,
+            std::chrono::milliseconds window);
+
+    FunnelReplay(const FunnelReplay &) = delete;
+    FunnelReplay &operator=(const FunnelReplay &) = delete;
+
+    // The clicks and conversions logged for an impression that won, by its
+    // bid id and log timestamp (yyyyMMddHHmmssSSS), each at most once (any thread)
+    std::vector<FunnelEvent> match(const std::string &bidId, const std::string &timestamp);
+
+    uint64_t clicks();
+
+    uint64_t conversions();
+
+    // log lines let go of without a won impression to join
+    uint64_t expired();
+
+    // the most log lines held at once
+    size_t maxHeld();
+
+private:
+    // one log, its lines indexed by bid id until they fall out of the window
+    class Side {
+    public:
+        Side(const std::vector<std::string> &files, const std::string &type);
+
+        // read the lines logged up to until
+        void readUntil(int64_t until);
+
+        // let go of the lines logged before since
+        void expire(int64_t since);
+
+        // take the lines for bidId logged from at to until
+        void take(const std::string &bidId, int64_t at, int64_t until, std::vector<FunnelEvent> &out);
+
+        size_t held() const {
+            return order.size();
+        }
+
+        uint64_t joined{0};
+        uint64_t expired{0};
+
+    private:
+        bool peek();
+
+        const std::vector<std::string> files;
+        const std::string type;
+        size_t nextFile;
+        std::ifstream log;
+        bool peeked;
+        std::string peekId;
+        int64_t peekAt;
+        std::unordered_map<std::string, std::vector<int64_t>> byId;
+        std::deque<std::pair<int64_t, std::string>> order;  // in log order, may include lines already taken
+    };
+
+    const int64_t window;
+    std::mutex mtx;
+    Side clickLog;
+    Side conversionLog;
+    int64_t latest;     // log time of the latest won impression
+    size_t maxheld;
+};
+
+// ms since 1970 of an iPinYou timestamp, yyyyMMddHHmmssSSS, or -1 if it is not one
+int64_t parseLogTime(const std::string &timestamp);
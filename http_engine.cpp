@@ -0,0 +1,670 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "http_engine.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <pthread.h>
+
+#include "reactor.h"
+#include "request_writer.h"
+#include "response_parser.h"
+
+using namespace std;
+
+std::string buildPost(const std::string &host, const std::string &path, const std::string &body,
+        const std::vector<std::pair<std::string, std::string>> &headers, const std::string &contentType) {
+    return RequestWriter(host, path, headers, contentType).render(body);
+}
+
+std::string buildGet(const std::string &host, const std::string &path) {
+    return "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: Keep-Alive\r\n\r\n";
+}
+
+Endpoint endpointFor(const std::string &site, unsigned short port) {
+    Endpoint endpoint{"localhost", port, ""};
+    if (isUnixSite(site)) {
+        endpoint.unixPath = site.substr(5);
+        return endpoint;
+    }
+    size_t start{site.find("://")};
+    start = start == string::npos ? 0 : start + 3;
+    size_t end{site.find_first_of(":/?", start)};
+    endpoint.host = site.substr(start, end == string::npos ? string::npos : end - start);
+    return endpoint;
+}
+
+namespace {
+
+const uint64_t wakeToken{~0ULL};
+const chrono::milliseconds maxWait{100};
+const chrono::milliseconds wheelTick{1};
+const size_t wheelSlots{1024};
+const chrono::milliseconds reconnectDelay{100};
+
+// Readiness based I/O: non-blocking sockets, each read and write a system call
+class EpollReactor : public Reactor {
+public:
+    EpollReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections, const EngineOptions &options);
+    ~EpollReactor();
+
+private:
+    void connect(Connection &c) override;
+    void release(Connection &c) override;
+    void flush(Connection &c) override;
+    void poll(chrono::milliseconds timeout) override;
+    void wake() override;
+
+    void interest(Connection &c, bool write);
+    void onReadable(size_t idx);
+
+    int epfd;
+    int wakefd;
+    vector<epoll_event> events;
+};
+
+EpollReactor::EpollReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections, const EngineOptions &options)
+: Reactor(engine, addr, addrlen, nconnections, options), events(256)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || wakefd < 0) {
+        throw runtime_error("Could not create epoll reactor: " + string(strerror(errno)));
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = wakeToken;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+    start();
+}
+
+EpollReactor::~EpollReactor() {
+    stop();
+    ::close(wakefd);
+    ::close(epfd);
+}
+
+void EpollReactor::wake() {
+    uint64_t one{1};
+    ssize_t r = write(wakefd, &one, sizeof (one));
+    (void) r;
+}
+
+void EpollReactor::connect(Connection &c) {
+    c.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0) {
+        c.retryAt = Clock::now() + reconnectDelay;
+        return;
+    }
+    if (addr.ss_family != AF_UNIX) {
+        int one{1};
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    }
+
+    int r = ::connect(c.fd, reinterpret_cast<const sockaddr *> (&addr), addrlen);
+    if (r < 0 && errno != EINPROGRESS) {
+        ::close(c.fd);
+        c.fd = -1;
+        c.retryAt = Clock::now() + reconnectDelay;
+        return;
+    }
+
+    c.state = ConnState::Connecting;
+    c.wantWrite = true;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u64 = static_cast<uint64_t> (indexOf(c));
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+}
+
+void EpollReactor::release(Connection &c) {
+    if (c.fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+        ::close(c.fd);
+    }
+}
+
+void EpollReactor::interest(Connection &c, bool write) {
+    if (c.wantWrite == write)
+        return;
+    c.wantWrite = write;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (write ? static_cast<uint32_t> (EPOLLOUT) : 0u);
+    ev.data.u64 = static_cast<uint64_t> (indexOf(c));
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void EpollReactor::flush(Connection &c) {
+    while (!c.out.empty()) {
+        // the queued heads and bodies in one call, as many as it takes
+        iovec pieces[64];
+        msghdr msg{};
+        msg.msg_iov = pieces;
+        for (auto it = c.out.begin(); it != c.out.end() && msg.msg_iovlen < 64; ++it) {
+            pieces[msg.msg_iovlen++] = *it;
+        }
+        ssize_t n = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                interest(c, true);
+                return;
+            }
+            close(c);
+            return;
+        }
+        written(c, n);
+    }
+    interest(c, false);
+}
+
+void EpollReactor::onReadable(size_t idx) {
+    Connection &c = conns[idx];
+    char buf[16384];
+    bool eof{false};
+    while (true) {
+        ssize_t n = recv(c.fd, buf, sizeof (buf), 0);
+        if (n > 0) {
+            c.in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        // peer closed or error: complete what has arrived, then drop the connection
+        eof = true;
+        break;
+    }
+    received(idx, eof);
+}
+
+void EpollReactor::poll(chrono::milliseconds timeout) {
+    int n = epoll_wait(epfd, events.data(), static_cast<int> (events.size()), static_cast<int> (timeout.count()));
+    for (int i = 0; i < n; ++i) {
+        if (events[i].data.u64 == wakeToken) {
+            uint64_t count;
+            ssize_t r = read(wakefd, &count, sizeof (count));
+            (void) r;
+            continue;
+        }
+        size_t idx{static_cast<size_t> (events[i].data.u64)};
+        Connection &c = conns[idx];
+        if (c.fd < 0)
+            continue;
+
+        if (c.state == ConnState::Connecting) {
+            int err{0};
+            socklen_t len{sizeof (err)};
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                close(c);
+                continue;
+            }
+            interest(c, false);
+            opened(idx);
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            onReadable(idx);
+        }
+        if (c.fd >= 0 && (events[i].events & EPOLLOUT)) {
+            flush(c);
+        }
+    }
+    if (n == static_cast<int> (events.size()))
+        events.resize(events.size() * 2);
+}
+
+} // namespace
+
+Reactor::Reactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections, const EngineOptions &options)
+: addr(addr), addrlen{addrlen}, conns(nconnections), engine(engine), depth{options.pipeline}, onTimeout{options.onTimeout},
+linger{options.linger}, retryPolicy(options.retry), running{false}, deadlines{wheelTick, wheelSlots}, seq{0}
+{
+}
+
+Reactor::~Reactor() {
+}
+
+void Reactor::start() {
+    running = true;
+    worker = thread(&Reactor::run, this);
+}
+
+void Reactor::stop() {
+    running = false;
+    wake();
+    worker.join();
+}
+
+chrono::microseconds Reactor::cpuTime() const {
+    clockid_t clock;
+    timespec ts{};
+    if (pthread_getcpuclockid(const_cast<thread &> (worker).native_handle(), &clock) != 0 || clock_gettime(clock, &ts) != 0)
+        return chrono::microseconds{0};
+    return chrono::microseconds{ts.tv_sec * 1000000LL + ts.tv_nsec / 1000};
+}
+
+void Reactor::post(HttpExchange &&ex) {
+    {
+        lock_guard<mutex> lck(mtx);
+        incoming.push_back(std::move(ex));
+    }
+    wake();
+}
+
+// Close the connection. Whatever was in flight on it has no response.
+void Reactor::close(Connection &c) {
+    release(c);
+    c.fd = -1;
+    c.state = ConnState::Closed;
+    c.out.clear();
+    c.queuedBytes = 0;
+    c.sentBytes = 0;
+    c.in.clear();
+    c.retryAt = Clock::now() + reconnectDelay;
+
+    deque<Pending> lost{};
+    lost.swap(c.inflight);
+    for (auto &p : lost) {
+        if (p.abandoned)
+            continue;
+        if (Clock::now() >= p.req.ex.deadline)
+            fail(p.req.ex, true);
+        else
+            retry(std::move(p.req));
+    }
+}
+
+// Send a request whose connection failed again after a backoff, if the
+// policy has a retry left for it and it can still make its deadline
+void Reactor::retry(Request &&req) {
+    if (!running || req.attempt >= retryPolicy.attempts) {
+        if (running)
+            ++engine.gaveUp;
+        fail(req.ex, false);
+        return;
+    }
+    const Clock::time_point at{Clock::now() + retryPolicy.backoff * (1 << min(req.attempt, 16u))};
+    if (!retryPolicy.keepDeadline)
+        req.ex.deadline = min(at + req.budget, req.cutoff);
+    if (at >= req.ex.deadline) {
+        fail(req.ex, true);
+        return;
+    }
+    ++req.attempt;
+    ++engine.retried;
+    retries.emplace(at, std::move(req));
+}
+
+void Reactor::opened(size_t idx) {
+    conns[idx].state = ConnState::Open;
+    makeReady(idx);
+}
+
+void Reactor::makeReady(size_t idx) {
+    Connection &c = conns[idx];
+    if (!c.ready && c.state == ConnState::Open && c.inflight.size() < depth) {
+        c.ready = true;
+        readyList.push_back(idx);
+    }
+}
+
+// Put waiting requests on connections that can take them. Connections take
+// turns, so with pipelining the requests spread out before any connection
+// gets a second one in flight.
+void Reactor::dispatch() {
+    while (!backlog.empty() && !readyList.empty()) {
+        size_t idx{readyList.front()};
+        readyList.pop_front();
+        Connection &c = conns[idx];
+        c.ready = false;
+        if (c.state != ConnState::Open || c.inflight.size() >= depth)
+            continue; // stale entry
+
+        auto first = backlog.begin();
+        c.inflight.push_back(Pending{std::move(first->second), first->first, false, 0, Clock::time_point::max()});
+        backlog.erase(first);
+        // written from where the pending request holds it, which stays put
+        // until the request is off the connection
+        Pending &p = c.inflight.back();
+        for (const string *s : {&p.req.ex.request, &p.req.ex.body}) {
+            if (!s->empty())
+                c.out.push_back(iovec{const_cast<char *> (s->data()), s->length()});
+            c.queuedBytes += s->length();
+        }
+        p.endByte = c.queuedBytes;
+        deadlines.schedule(p.req.ex.deadline, Expiry{idx, p.seq});
+        flush(c);
+        if (c.fd >= 0)
+            makeReady(idx);
+    }
+}
+
+// n more bytes of c.out have been handed to the kernel. Record the write
+// time of the requests whose last byte has just gone out.
+void Reactor::written(Connection &c, size_t n) {
+    c.sentBytes += n;
+    while (n > 0) {
+        iovec &piece = c.out.front();
+        if (n < piece.iov_len) {
+            piece.iov_base = static_cast<char *> (piece.iov_base) + n;
+            piece.iov_len -= n;
+            break;
+        }
+        n -= piece.iov_len;
+        c.out.pop_front();
+    }
+
+    Clock::time_point now{Clock::now()};
+    for (auto it = c.inflight.rbegin(); it != c.inflight.rend(); ++it) {
+        if (it->written != Clock::time_point::max())
+            break;
+        if (it->endByte <= c.sentBytes)
+            it->written = now;
+    }
+}
+
+// New bytes are in c.in: complete the requests whose responses are whole
+void Reactor::received(size_t idx, bool eof) {
+    Connection &c = conns[idx];
+    size_t used{0};
+    ParsedResponse parsed{};
+    while (!c.inflight.empty()) {
+        ParseResult r{parseResponse(&c.in[used], c.in.length() - used, parsed)};
+        if (r == ParseResult::Incomplete)
+            break;
+        if (r != ParseResult::Complete) {
+            engine.malformed(r);
+            close(c);
+            return;
+        }
+        used += parsed.length;
+
+        Pending p{std::move(c.inflight.front())};
+        c.inflight.pop_front();
+        if (p.abandoned) {
+            ++engine.late;
+        } else {
+            HttpResult res{parsed.status, false, string(parsed.body, parsed.bodyLength), {}};
+            res.latency = chrono::duration_cast<chrono::microseconds>(Clock::now() - p.written);
+            complete(p.req.ex, res);
+        }
+
+        // answered before it was all written: c.out still points into it
+        if (parsed.close || p.endByte > c.sentBytes) {
+            close(c);
+            return;
+        }
+    }
+    c.in.erase(0, used);
+
+    if (eof || (c.inflight.empty() && !c.in.empty())) {
+        close(c); // closed by the peer, or unsolicited data
+        return;
+    }
+    makeReady(idx);
+}
+
+// A deadline has passed. A request still in the backlog simply fails. One in
+// flight is either abandoned, i.e. reported as timed out while the connection
+// keeps waiting for (and then discards) its response, or aborted by closing
+// the connection. An abandoned request whose response has not come after the
+// linger time takes the connection down as well.
+void Reactor::expire(const Expiry &e) {
+    if (e.conn == noConnection) {
+        auto it = backlog.find(e.seq);
+        if (it != backlog.end()) {
+            fail(it->second.ex, true);
+            backlog.erase(it);
+        }
+        return;
+    }
+
+    Connection &c = conns[e.conn];
+    for (auto &p : c.inflight) {
+        if (p.seq != e.seq)
+            continue;
+        if (p.abandoned || onTimeout == TimeoutPolicy::Abort) {
+            abort(c, e.seq);
+        } else {
+            p.abandoned = true;
+            fail(p.req.ex, true);
+            deadlines.schedule(Clock::now() + linger, e);
+        }
+        return;
+    }
+}
+
+// Close c on purpose, for request cause that ran out of time. The other
+// requests in flight on it did nothing wrong: they go back to the backlog
+// as they are, without spending a retry.
+void Reactor::abort(Connection &c, uint64_t cause) {
+    deque<Pending> others{};
+    others.swap(c.inflight);
+    close(c);
+
+    const Clock::time_point now{Clock::now()};
+    for (auto &p : others) {
+        if (p.abandoned)
+            continue;
+        if (p.seq == cause || now >= p.req.ex.deadline) {
+            fail(p.req.ex, true);
+        } else {
+            // a new seq, as the expiry for the old one may still find the
+            // connection it was on
+            deadlines.schedule(p.req.ex.deadline, Expiry{noConnection, seq});
+            backlog.emplace(seq++, std::move(p.req));
+        }
+    }
+}
+
+void Reactor::complete(HttpExchange &ex, HttpResult &res) {
+    if (ex.onResponse)
+        ex.onResponse(res);
+    engine.completed();
+}
+
+void Reactor::fail(HttpExchange &ex, bool timedOut) {
+    HttpResult res{0, timedOut, {}, {}};
+    complete(ex, res);
+}
+
+void Reactor::run() {
+    for (auto &c : conns) {
+        connect(c);
+    }
+
+    while (running) {
+        Clock::time_point now{Clock::now()};
+        Clock::time_point wakeAt{now + maxWait};
+        if (!deadlines.empty())
+            wakeAt = min(wakeAt, deadlines.nextDue());
+        if (!retries.empty() && retries.begin()->first < wakeAt)
+            wakeAt = retries.begin()->first;
+        // rounded up, so as not to wake a little before a deadline and spin
+        auto timeout = chrono::duration_cast<chrono::milliseconds>(wakeAt - now);
+        if (timeout < wakeAt - now)
+            ++timeout;
+        poll(timeout.count() > 0 ? timeout : chrono::milliseconds{0});
+
+        {
+            lock_guard<mutex> lck(mtx);
+            while (!incoming.empty()) {
+                HttpExchange &ex = incoming.front();
+                deadlines.schedule(ex.deadline, Expiry{noConnection, seq});
+                const Clock::duration budget{ex.deadline - now};
+                const Clock::time_point cutoff{ex.cutoff == Clock::time_point{} ? ex.deadline : ex.cutoff};
+                backlog.emplace(seq++, Request{std::move(ex), 0, budget, cutoff});
+                incoming.pop_front();
+            }
+        }
+
+        now = Clock::now();
+        while (!retries.empty() && retries.begin()->first <= now) {
+            Request &req = retries.begin()->second;
+            deadlines.schedule(req.ex.deadline, Expiry{noConnection, seq});
+            backlog.emplace(seq++, std::move(req));
+            retries.erase(retries.begin());
+        }
+        for (auto &c : conns) {
+            if (c.state == ConnState::Closed && c.retryAt <= now && reusable(c)) {
+                ++engine.reconnected;
+                connect(c);
+            }
+        }
+        dispatch();
+        deadlines.advance(Clock::now(), [this](const Expiry & e) {
+            expire(e);
+        });
+    }
+
+    // shutting down: nothing more will be answered
+    for (auto &c : conns) {
+        close(c);
+    }
+    for (auto &b : backlog) {
+        fail(b.second.ex, false);
+    }
+    backlog.clear();
+    for (auto &r : retries) {
+        fail(r.second.ex, false);
+    }
+    retries.clear();
+}
+
+Reactor *newEpollReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections,
+        const EngineOptions &options) {
+    return new EpollReactor(engine, addr, addrlen, nconnections, options);
+}
+
+HttpEngine::HttpEngine(const Endpoint &endpoint, const EngineOptions &options)
+: late{0}, retried{0}, gaveUp{0}, reconnected{0}, next{0}, maxOutstanding{options.outstanding > 0 ? options.outstanding : 1}, inFlight{0}
+{
+    sockaddr_storage addr{};
+    socklen_t addrlen{0};
+    if (!endpoint.unixPath.empty()) {
+        sockaddr_un *un{reinterpret_cast<sockaddr_un *> (&addr)};
+        if (endpoint.unixPath.length() >= sizeof (un->sun_path)) {
+            throw runtime_error("Unix socket path too long: " + endpoint.unixPath);
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, endpoint.unixPath.c_str());
+        addrlen = static_cast<socklen_t> (offsetof(sockaddr_un, sun_path) + endpoint.unixPath.length() + 1);
+    } else {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *res{nullptr};
+        string port{to_string(endpoint.port)};
+        if (getaddrinfo(endpoint.host.c_str(), port.c_str(), &hints, &res) != 0 || res == nullptr) {
+            throw runtime_error("Host not found: " + endpoint.host + ", port: " + port);
+        }
+        memcpy(&addr, res->ai_addr, res->ai_addrlen);
+        addrlen = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+
+    io = options.io;
+    if (io == IoBackend::Uring && !uringAvailable()) {
+        cerr << "io_uring is not available, using epoll" << endl;
+        io = IoBackend::Epoll;
+    }
+
+    EngineOptions opts{options};
+    if (opts.pipeline < 1)
+        opts.pipeline = 1;
+    if (opts.reactors < 1)
+        opts.reactors = 1;
+    if (opts.connections < opts.reactors)
+        opts.connections = opts.reactors;
+    for (int i = 0; i < opts.reactors; ++i) {
+        int share{opts.connections / opts.reactors + (i < opts.connections % opts.reactors ? 1 : 0)};
+        if (io == IoBackend::Uring) {
+            reactors.push_back(unique_ptr<Reactor>(newUringReactor(*this, addr, addrlen, share, opts)));
+        } else {
+            reactors.push_back(unique_ptr<Reactor>(newEpollReactor(*this, addr, addrlen, share, opts)));
+        }
+    }
+}
+
+HttpEngine::~HttpEngine() {
+    reactors.clear();
+}
+
+chrono::microseconds HttpEngine::cpuTime() const {
+    chrono::microseconds total{0};
+    for (auto &r : reactors) {
+        total += r->cpuTime();
+    }
+    return total;
+}
+
+void HttpEngine::submit(HttpExchange &&ex) {
+    {
+        unique_lock<mutex> lck(mtx);
+        cv.wait(lck, [this] {
+            return inFlight.load() < maxOutstanding;
+        });
+        ++inFlight;
+    }
+    reactors[next++ % reactors.size()]->post(std::move(ex));
+}
+
+bool HttpEngine::trySubmit(HttpExchange &&ex) {
+    {
+        lock_guard<mutex> lck(mtx);
+        if (inFlight.load() >= maxOutstanding)
+            return false;
+        ++inFlight;
+    }
+    reactors[next++ % reactors.size()]->post(std::move(ex));
+    return true;
+}
+
+void HttpEngine::drain() {
+    unique_lock<mutex> lck(mtx);
+    cv.wait(lck, [this] {
+        return inFlight.load() == 0;
+    });
+}
+
+void HttpEngine::malformed(ParseResult result) {
+    lock_guard<mutex> lck(mtx);
+    ++malformedCounts[describe(result)];
+}
+
+map<string, uint64_t> HttpEngine::malformedResponses() const {
+    lock_guard<mutex> lck(mtx);
+    return malformedCounts;
+}
+
+void HttpEngine::completed() {
+    {
+        lock_guard<mutex> lck(mtx);
+        --inFlight;
+    }
+    cv.notify_all();
+}
@@ -0,0 +1,183 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Non-blocking HTTP/1.1 client engine. A few reactor threads each multiplex
+// many keep-alive connections to one endpoint with epoll or io_uring, so that
+// thousands of requests can be outstanding at the same time.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+
+#include "response_parser.h"
+
+// Where the engine connects to: host and port, or a unix domain socket
+struct Endpoint {
+    std::string host;
+    unsigned short port;
+    std::string unixPath;   // if set, host and port are not used
+};
+
+// The endpoint for a site from the configuration, either a URL such as
+// http://bidder.example.com (the port is given separately) or unix:/path
+Endpoint endpointFor(const std::string &site, unsigned short port);
+
+inline bool isUnixSite(const std::string &site) {
+    return site.compare(0, 5, "unix:") == 0;
+}
+
+// Outcome of one request/response exchange
+struct HttpResult {
+    int status;                         // HTTP status code, 0 if no response was received
+    bool timedOut;                      // the deadline passed before the response was complete
+    std::string body;
+    std::chrono::microseconds latency;  // from the request's last byte being written until the response was complete
+};
+
+typedef std::function<void(HttpResult &)> ResponseHandler;
+
+// What happens to a request in flight when its deadline passes
+enum class TimeoutPolicy {
+    Abandon,    // report the timeout, keep the connection and discard the late response
+    Abort       // report the timeout and close the connection
+};
+
+// How the reactors do their socket I/O
+enum class IoBackend {
+    Epoll,      // readiness notification, a system call per read and write
+    Uring       // io_uring: the reads and writes of all connections go in one batch per loop
+};
+
+// What happens to a request whose connection fails before its response is in
+struct RetryPolicy {
+    unsigned attempts;                  // sends after the first one, 0 to fail the request at once
+    std::chrono::milliseconds backoff;  // wait before the first retry, doubled for each one after that
+    bool keepDeadline;                  // a retry must still make the original deadline, or else gets
+                                        // as long as the first send had, from when it goes, up to the
+                                        // exchange's cutoff
+};
+
+struct EngineOptions {
+    int reactors;                       // reactor threads
+    int connections;                    // keep-alive connections, spread over the reactors
+    size_t outstanding;                 // requests in flight before submit() blocks
+    size_t pipeline;                    // requests in flight per connection (HTTP/1.1 pipelining)
+    TimeoutPolicy onTimeout;
+    std::chrono::milliseconds linger;   // how long an abandoned request may hold its connection
+    IoBackend io;                       // Uring falls back to Epoll if the kernel does not have it
+    RetryPolicy retry;
+};
+
+// A request to send and what to do with its response
+struct HttpExchange {
+    std::string request;                                // complete HTTP request, or its head if body is set
+    std::chrono::steady_clock::time_point deadline;     // give up on the response after this
+    ResponseHandler onResponse;                         // called once, on a reactor thread
+    std::string body;                                   // written right after request, without joining the two
+    std::chrono::steady_clock::time_point cutoff;       // no retry runs past this, the deadline if left unset
+};
+
+// Build a keep-alive POST request for the given host. For many requests
+// to the same place, a RequestWriter saves rendering the headers each time.
+std::string buildPost(const std::string &host, const std::string &path, const std::string &body,
+        const std::vector<std::pair<std::string, std::string>> &headers = {},
+        const std::string &contentType = "application/json");
+
+// Build a keep-alive GET request for the given host
+std::string buildGet(const std::string &host, const std::string &path);
+
+class Reactor;
+
+class HttpEngine {
+public:
+    // With a pipeline depth above one, up to that many requests are written
+    // on a connection before the first response is back. Requests are
+    // reported as timed out when their deadline passes, and do not count
+    // against the outstanding window after that.
+    HttpEngine(const Endpoint &endpoint, const EngineOptions &options);
+    ~HttpEngine();
+
+    HttpEngine(const HttpEngine &) = delete;
+    HttpEngine &operator=(const HttpEngine &) = delete;
+
+    void submit(HttpExchange &&ex);
+
+    // like submit(), but returns false instead of blocking when the window of
+    // outstanding requests is full
+    bool trySubmit(HttpExchange &&ex);
+
+    // wait until every submitted request has completed
+    void drain();
+
+    size_t outstanding() const {
+        return inFlight.load();
+    }
+
+    // responses that arrived after their request had been abandoned
+    uint64_t lateResponses() const {
+        return late.load();
+    }
+
+    // requests sent again after their connection failed
+    uint64_t retries() const {
+        return retried.load();
+    }
+
+    // requests that failed when no retries were left
+    uint64_t givenUp() const {
+        return gaveUp.load();
+    }
+
+    // connections made again after they had failed or been closed
+    uint64_t reconnects() const {
+        return reconnected.load();
+    }
+
+    // responses that could not be parsed (and took their connection down), by what was wrong
+    std::map<std::string, uint64_t> malformedResponses() const;
+
+    // the I/O the reactors actually use
+    IoBackend backend() const {
+        return io;
+    }
+
+    // CPU time the reactor threads have used
+    std::chrono::microseconds cpuTime() const;
+
+private:
+    friend class Reactor;
+    void completed();
+    void malformed(ParseResult result);
+
+    std::atomic<uint64_t> late;
+    std::atomic<uint64_t> retried;
+    std::atomic<uint64_t> gaveUp;
+    std::atomic<uint64_t> reconnected;
+    IoBackend io;
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    std::atomic<size_t> next;
+    const size_t maxOutstanding;
+    std::atomic<size_t> inFlight;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    std::map<std::string, uint64_t> malformedCounts;
+};
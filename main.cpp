@@ -21,18 +21,27 @@
 #include <chrono>
 #include <random>
 #include <vector>
+#include <memory>
+#include <limits>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <algorithm>
 #include <cassert>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 // Poco lib includes
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/IPAddress.h>
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/StreamSocket.h>
 #include "Poco/Net/NetException.h"
+#include <Poco/Timespan.h>
 #include <Poco/StreamCopier.h>
 #include <Poco/Path.h>
 #include <Poco/URI.h>
@@ -50,6 +59,19 @@
 #include "json/json.h"
 #include "aux_info.h"
 #include "bid.h"
+#include "http_engine.h"
+#include "arrival.h"
+#include "stats.h"
+#include "control.h"
+#include "bench.h"
+#include "mock_bidder.h"
+#include "notice_dispatcher.h"
+#include "event_scheduler.h"
+#include "funnel_replay.h"
+#include "funnel_model.h"
+#include "request_writer.h"
+#include "url_template.h"
+#include "price_cipher.h"
 
 using namespace Poco::Net;
 using namespace Poco;
@@ -64,29 +86,15 @@ using Poco::AutoPtr;
 using namespace std;
 
 
-struct event {
-    float timestamp;
-    string bidRequestId;
-    string impId;
-    string type;
-    Logger & logger;
-};
-
-// Shared queue for click events
-condition_variable cv_clicks;
-mutex mtx_clicks;
-vector<event> clicks;
-
-// Shared queue for conversion events
-condition_variable cv_conversions;
-mutex mtx_conversions;
-vector<event> conversions;
-
 Json::Value configuration{};
 
+// bid replies that did not make it within tmax, per bidder and slot size
+KeyedCounters timeouts{};
 
-std::default_random_engine generator;
-std::uniform_int_distribution<int> rand100(0, 100);
+
+// one engine per thread, the auction also runs on the engine's reactor threads
+thread_local std::default_random_engine generator;
+thread_local std::uniform_int_distribution<int> rand100(0, 100);
 
 Json::Value readConf(const std::string confFile) {
     ifstream confs(confFile);
@@ -100,263 +108,954 @@ Json::Value readConf(const std::string confFile) {
     return configuration;
 }
 
-// sends a win notice to the RTBkit
+// A session that sends bid requests raw, with a RequestWriter, and parses
+// the replies straight off its own receive buffer, instead of going through
+// sendRequest() and receiveResponse(). Poco still makes the connection.
 
-void sendWin(Logger & logger, string nurl, string bidRequestId, string impId, float winPrice) {
-    URI uri(nurl);
+class RawClientSession : public HTTPClientSession {
+public:
 
-    const string host{uri.getHost()};
-    const unsigned short port{static_cast<unsigned short> (configuration["winport"].asInt())};
-    const string query{uri.getQuery()};
+    // what became of the reply to a request
+    enum class Reply {
+        Complete, TimedOut, Closed, Malformed
+    };
 
-    vector<string> pathSegments{};
-    uri.getPathSegments(pathSegments);
+    RawClientSession(const string &host, unsigned short port) : HTTPClientSession(host, port), consumed{0} {
+    }
 
+    bool sendRaw(const RequestWriter &writer, const string &body) {
+        if (!connected()) {
+            reconnect();
+        }
+        return writer.send(socket().impl()->sockfd(), body);
+    }
 
-    try {
-        HTTPClientSession session(host, port);
+    // Read until the reply is complete, the deadline passes or the bidder
+    // closes the connection. A complete reply's body is valid until the next
+    // call; a malformed one's ParseResult is left in error.
+    Reply receiveRaw(ParsedResponse &reply, ParseResult &error, chrono::steady_clock::time_point deadline) {
+        in.erase(0, consumed);
+        consumed = 0;
+        const int fd{socket().impl()->sockfd()};
+        for (;;) {
+            if (!in.empty()) {
+                error = parseResponse(&in[0], in.length(), reply);
+                if (error == ParseResult::Complete) {
+                    consumed = reply.length;
+                    if (reply.close)
+                        reset(); // connect again for the next request
+                    return Reply::Complete;
+                } else if (error != ParseResult::Incomplete) {
+                    return Reply::Malformed;
+                }
+            }
 
-        if (configuration["wnstyle"].asString() == "smaato") {
+            const auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if (left <= 0)
+                return Reply::TimedOut;
+            pollfd pfd{fd, POLLIN, 0};
+            int r = ::poll(&pfd, 1, static_cast<int> (left));
+            if (r == 0)
+                return Reply::TimedOut;
+            char buf[16384];
+            ssize_t n = r < 0 ? -1 : recv(fd, buf, sizeof (buf), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return Reply::Closed;
+            in.append(buf, n);
+        }
+    }
 
+    // drop the connection and whatever has been received on it
+    void restart() {
+        in.clear();
+        consumed = 0;
+        reset();
+    }
 
-            std::string winNotice{""};
+private:
+    string in;
+    size_t consumed;    // the reply last returned, taken off at the next call
+};
 
-            // build the winNotice based on the nurl substitution macros
-            for (auto ps : pathSegments) {
-                if (ps == "${AUCTION_ID}") {
-                    winNotice += "/" + bidRequestId;
-                } else if (ps == "${AUCTION_IMP_ID}") {
-                    winNotice += "/" + impId;
-                } else if (ps == "${AUCTION_PRICE}") {
-                    winNotice += "/" + to_string(winPrice * 0.9765432); // arbitrary scaling
-                } else {
-                    winNotice += "/" + ps;
-                }
-            }
+// post-auction notices go out through this, never holding up an auction
+unique_ptr<NoticeDispatcher> notices{};
 
-            // debug
-            //cerr << "winNotice: " << winNotice << endl;
+// how wins are sent and where events go, read once at startup, as the notices
+// are sent from the reactor and sender threads and operator[] of the shared
+// configuration would insert a missing key
+bool smaatoWins{false};
+string eventsSite{};
+string eventsHost{};
+unsigned short eventsPort{0};
 
-            HTTPRequest request(HTTPRequest::HTTP_GET, winNotice);
-            //	request.setKeepAlive(true);
+// with "pricecipher", ${AUCTION_PRICE} is encrypted as the exchanges do it
+unique_ptr<PriceCipher> priceCipher{};
 
-            std::ostream& myOStream = session.sendRequest(request); // sends request, returns open stream
+string auctionPrice(double price) {
+    return priceCipher ? priceCipher->encrypt(price) : to_string(price);
+}
 
-            if (!myOStream.good()) {
-                cerr << "Problem sending win notice header..." << endl;
-            }
+// billing and loss notices go out after a delay drawn from these
+unique_ptr<DelayDistribution> billingDelay{};
+unique_ptr<DelayDistribution> lossDelay{};
+atomic<uint64_t> nbilling{0};
+atomic<uint64_t> nlosses{0};
+
+// clicks and conversions are sent through this when they fall due, each
+// after a delay drawn from its distribution
+unique_ptr<EventScheduler> events{};
+unique_ptr<DelayDistribution> clickDelay{};
+unique_ptr<DelayDistribution> conversionDelay{};
+
+// how likely a won impression is to be clicked and a click to convert, by segment
+unique_ptr<FunnelModel> funnel{};
+
+// with "replay", the clicks and conversions come from the iPinYou logs instead
+unique_ptr<FunnelReplay> replay{};
+int replaySpeedup{1};
+
+// Stop the event senders, then let the notices in flight finish and the
+// dispatcher go, and only then tear down the scheduler, replay and funnel
+// model its callbacks use. Run on every way out of main, never left to the
+// destruction of the globals, which would take them in the wrong order.
+void shutDown() {
+    if (events)
+        events->stop();
+    if (notices) {
+        notices->drain();
+        notices.reset();
+    }
+    events.reset();
+    replay.reset();
+    funnel.reset();
+}
 
-        } else {
-            // It's rtbkit style, send the win notice as POST JSON
-            chrono::system_clock::time_point tp = chrono::system_clock::now();
-            int ts = std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
+struct ShutDownAtExit {
+    ~ShutDownAtExit() {
+        shutDown();
+    }
+};
 
-            Json::Value wn;
-            wn["timestamp"] = static_cast<float>(ts);
-            wn["bidRequestId"] = bidRequestId;
-            wn["impid"] = impId;
-            wn["price"] = winPrice * 0.9765432;
+// the macro values a bid in a reply gives, before the auction sets its price
 
-            stringstream reqStream{};
-            reqStream << wn;
-            string reqBody{reqStream.str()};
+AuctionMacros macrosOf(const string &auctionId, const Json::Value &reply, const Json::Value &seat, const Json::Value &bid) {
+    return AuctionMacros{auctionId, bid["id"].asString(), bid["impid"].asString(), seat["seat"].asString(),
+        bid["adid"].asString(), reply.get("cur", "USD").asString(), "", bid["price"].asDouble(), 0.0, 0};
+}
 
-            HTTPRequest request(HTTPRequest::HTTP_POST, "/wins");
-            request.setKeepAlive(true);
+// hands a GET of url, with its macros filled in, to the notice dispatcher
+// for winSite and port, after a delay drawn from delay
 
-            request.setContentType("application/json");
+void sendDelayed(const string &url, const AuctionMacros &macros, const DelayDistribution &delay, unsigned short port,
+        const string &winSite) {
+    thread_local default_random_engine rng{random_device{}()};
+    shared_ptr<const UrlTemplate> urlTemplate{UrlTemplate::of(url)};
+    const string host{isUnixSite(winSite) ? "localhost" : urlTemplate->host()};
+    notices->dispatchAfter(delay.draw(rng), winSite, port, buildGet(host, urlTemplate->target(macros)));
+}
 
-            request.setContentLength(reqBody.length());
+// hands a win notice for the RTBkit to the notice dispatcher, for winSite and
+// port, and the billing notice to burl if the bid has one. With winSite a
+// unix:/path the notices go over that socket.
 
-            // debug
-            //cerr << "host: " << host << ", port: " << port << endl;
-            //cerr << "winNotice: " << wn << endl;
+void sendWin(Logger & logger, const string &nurl, const string &burl, AuctionMacros macros, const ImpressionObject & imp,
+        float winPrice, unsigned short port, const string &winSite) {
+    const string &bidRequestId = macros.auctionId;
+    shared_ptr<const UrlTemplate> nurlTemplate{};
+    try {
+        nurlTemplate = UrlTemplate::of(nurl);
+    } catch (const runtime_error &ex) {
+        cerr << "Problem with win notice URL: " << ex.what() << endl;
+        return;
+    }
 
-            std::ostream& myOStream = session.sendRequest(request); // sends request, returns open stream
+    const string host{isUnixSite(winSite) ? "localhost" : nurlTemplate->host()};
 
-            if (!myOStream.good()) {
-                cerr << "Problem sending event header..." << endl;
-            }
+    macros.impId = imp.id;
+    macros.clearingPrice = winPrice * 0.9765432; // arbitrary scaling
+    macros.price = auctionPrice(macros.clearingPrice);
+    macros.loss = 0;
 
-            myOStream << reqBody; // sends the body
-            if (!myOStream.good()) {
-                cerr << "Problem sending event body..." << endl;
-            }
+    string request{};
+    if (smaatoWins) {
+        // fill in the nurl substitution macros
+        request = buildGet(host, nurlTemplate->target(macros));
+    } else {
+        // It's rtbkit style, send the win notice as POST JSON
+        chrono::system_clock::time_point tp = chrono::system_clock::now();
+        int ts = std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
+
+        Json::Value wn;
+        wn["timestamp"] = static_cast<float>(ts);
+        wn["bidRequestId"] = bidRequestId;
+        wn["impid"] = imp.id;
+        wn["price"] = macros.clearingPrice;
+
+        Json::FastWriter writer{};
+        request = writer.write(wn);
+    }
 
-        } // else wnStyle rtbkit
+    logger.information("WIN\t" + bidRequestId);
+
+    // once the notice is in, replay the clicks and conversions logged for the
+    // impression, or else those the funnel model draws for its log line
+    bool clicked{false};
+    bool converted{false};
+    chrono::steady_clock::duration clickAfter{};
+    chrono::steady_clock::duration conversionAfter{};
+    if (!replay) {
+        CounterRng rng{funnel->seed(), imp.logId};
+        clicked = funnel->clicked(imp.segment, rng);
+        if (clicked) {
+            converted = funnel->converted(imp.segment, rng);
+            clickAfter = clickDelay->draw(rng);
+            conversionAfter = clickAfter + conversionDelay->draw(rng);
+        }
+    }
+    auto onDelivered = [bidRequestId, imp, clicked, converted, clickAfter, conversionAfter] {
+        if (replay) {
+            for (auto &e : replay->match(imp.logId, imp.logTime)) {
+                events->schedule(e.offset / replaySpeedup, bidRequestId, imp.id, e.type);
+            }
+            return;
+        }
+        if (clicked)
+            events->schedule(clickAfter, bidRequestId, imp.id, "CLICK");
+        if (converted)
+            events->schedule(conversionAfter, bidRequestId, imp.id, "CONVERSION");
+    };
+    if (smaatoWins) {
+        notices->dispatch(winSite, port, std::move(request), onDelivered);
+    } else {
+        // rtbkit style notices may go out in batches
+        notices->post(winSite, port, host, "/wins", request, onDelivered);
+    }
 
+    if (!burl.empty()) {
+        try {
+            sendDelayed(burl, macros, *billingDelay, port, winSite);
+            ++nbilling;
+        } catch (const runtime_error &ex) {
+            cerr << "Problem with billing notice URL: " << ex.what() << endl;
+        }
+    }
+}
 
+// OpenRTB 2.5 loss reason codes
+const int lossBelowFloor{100};
+const int lossOutbid{102};
 
-        logger.information("WIN\t" + bidRequestId);
+// sends a loss notice to a bidder that did not win, if its bid carries an
+// lurl, to the bidder's winSite and port like its win notices
 
-        HTTPResponse winNoticeResponse{};
-        istream& rs = session.receiveResponse(winNoticeResponse);
-        // debug
-        //cerr << "WinNotice response:" << endl;
-        //StreamCopier::copyStream(rs, cerr);
-    } catch (const Poco::Net::HostNotFoundException &noHostEx) {
-        std::cerr << "Host Not found: " << host << ", port: " << port << std::endl;
-        exit(-1);
+void sendLoss(Logger & logger, const string &lurl, AuctionMacros macros, float clearingPrice, int reason,
+        unsigned short port, const string &winSite) {
+    logger.information("LOSS\t" + macros.auctionId);
+    if (lurl.empty()) {
+        return;
     }
 
-    // for every win, enter a click with some probability
-    // 20% chance to get a click
-    if (rand100(generator) < 20) {
-        unique_lock<mutex> lck(mtx_clicks);
-        event ev{0.0, bidRequestId, impId, "CLICK", logger};
-        clicks.push_back(ev);
+    macros.clearingPrice = clearingPrice;
+    macros.price = auctionPrice(clearingPrice);
+    macros.loss = reason;
+    try {
+        sendDelayed(lurl, macros, *lossDelay, port, winSite);
+        ++nlosses;
+    } catch (const runtime_error &ex) {
+        cerr << "Problem with loss notice URL: " << ex.what() << endl;
     }
+}
 
 
-}
+// sends a PostAuction event through the notice dispatcher, which keeps the
+// connections to the events endpoint open and shares them among the senders
 
+void sendPAEvent(Logger & logger, const string &bidRequestId, const string &impId, const string &type) {
+    chrono::system_clock::time_point tp = chrono::system_clock::now();
+    int ts = std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
 
-// sends a PostAuction event
+    Json::Value event;
+    event["timestamp"] = static_cast<float>(ts);
+    event["bidRequestId"] = bidRequestId;
+    event["impid"] = impId;
+    event["type"] = type; // CLICK or CONVERSION
 
-void sendPAEvent(Logger & logger, string bidRequestId, string impId, string type) {
+    Json::FastWriter writer{};
+    notices->post(eventsSite, eventsPort, eventsHost, "/", writer.write(event));
+    logger.information(type + "\t" + bidRequestId);
+}
 
-    // prepare session
-    string uri_string = configuration["winsite"].asString();
-    URI uri(uri_string);
-    string host { uri.getHost() };
-    unsigned short port { static_cast<unsigned short>(configuration["eventsport"].asInt()) };
+// filter out requests we do not send and fill in exchange specific fields.
+// Returns false if the request should be skipped.
 
-    try {
+bool prepareRequest(BidRequest &br) {
+    // a log line with a field that is not a number
+    if (br.region < 0 || br.adexchange < 0 || br.imp[0].bidfloor < 0 || br.bidding_price < 0 || br.paying_price < 0) {
+        return false;
+    }
 
-        HTTPClientSession session(host, port );
-        session.setKeepAlive(true);
+    // filter all br that are not of format 300x50 or 300x250
+    int height = {br.imp[0].banner.h};
+    int width = {br.imp[0].banner.w};
 
-        chrono::system_clock::time_point tp = chrono::system_clock::now();
-        int ts = std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
-        
-        Json::Value clickEvent;
-        clickEvent["timestamp"] = static_cast<float>(ts);
-        clickEvent["bidRequestId"] = bidRequestId;
-        clickEvent["impid"] = impId;
-        clickEvent["type"] = type; // CLICK or CONVERSION
+    if (width != 300) {
+        return false;
+    } else if ((height != 50) && (height != 250)) {
+        return false;
+    }
 
-        stringstream reqStream{};
-        reqStream << clickEvent;
-        string reqBody{reqStream.str()};
+    br.imp[0].segment = funnel->cellOf(width, height, br.region, br.adexchange, br.device.ua);
 
-        HTTPRequest request(HTTPRequest::HTTP_POST, "/");
-        request.setKeepAlive(true);
+    // set blocked categories 
+    br.bcat.push_back("IAB22");
+    // set fake operator
+    br.ext.carrierName = "personal";
 
-        request.setContentType("application/json");
+    return true;
+}
 
-        request.setContentLength(reqBody.length());
+// Reads bid requests off the impression log, up to byte end (0 for all of
+// it). With coalesce above 1, log lines from the same ad exchange are packed
+// into one request of that many impressions, each with its own size and
+// floor, under the id and device of the first line.
 
-        // debug
-        //cerr << "clickEvent: " << clickEvent << endl;
+class RequestSource {
+public:
+    RequestSource(istream &bids, streamoff end, chrono::milliseconds tmax, size_t coalesce)
+    : bids(bids), end{end}, tmax{tmax}, coalesce{coalesce}
+    {
+    }
 
-        std::ostream& myOStream = session.sendRequest(request); // sends request, returns open stream
+    // the next request, null when the log is used up
+    unique_ptr<BidRequest> next() {
+        while (!bids.eof() && (end == 0 || bids.tellg() < end)) {
+            unique_ptr<BidRequest> br{new BidRequest{tmax}};
+            bids >> *br; // one line at a time
+            if (!prepareRequest(*br)) {
+                continue;
+            } else if (coalesce <= 1) {
+                return br;
+            }
 
-        if (!myOStream.good()) {
-            cerr << "Problem sending " << type << " event header..." << endl;
+            unique_ptr<BidRequest> &batch = open[br->adexchange];
+            if (!batch) {
+                batch = std::move(br);
+            } else {
+                const ImpressionObject &imp = br->imp[0];
+                batch->imp.push_back(ImpressionObject{to_string(batch->imp.size() + 1), imp.banner, imp.bidfloor});
+                batch->imp.back().logId = imp.logId;
+                batch->imp.back().logTime = imp.logTime;
+                batch->imp.back().segment = imp.segment;
+            }
+            if (batch->imp.size() >= coalesce) {
+                unique_ptr<BidRequest> full{std::move(batch)};
+                open.erase(full->adexchange);
+                return full;
+            }
         }
 
-        myOStream << reqBody; // sends the body
-        if (!myOStream.good()) {
-            cerr << "Problem sending " << type << " event body..." << endl;
+        // what is left, one partly filled request at a time
+        if (open.empty()) {
+            return nullptr;
         }
+        unique_ptr<BidRequest> last{std::move(open.begin()->second)};
+        open.erase(open.begin());
+        return last;
+    }
 
-        logger.information(type + "\t" + bidRequestId);
+private:
+    istream &bids;
+    const streamoff end;
+    const chrono::milliseconds tmax;
+    const size_t coalesce;
+    map<int, unique_ptr<BidRequest>> open;     // requests being filled, by ad exchange
+};
+
+// names of the ad slot sizes a request is for, one per impression, e.g. 300x250
 
-        HTTPResponse clickEventResponse{};
-        istream& rs = session.receiveResponse(clickEventResponse);
-        //
-        //std::cerr << type << " event response:" << endl;
-        //StreamCopier::copyStream(rs, std::cerr);
-    } catch (const Poco::Net::HostNotFoundException &noHostEx) {
-        std::cerr << "SendPAevent: Host Not found: " << host << ", port: " << port << std::endl;
-        exit(-1);
+vector<string> slotNames(const BidRequest &br) {
+    vector<string> slots{};
+    for (auto &imp : br.imp) {
+        slots.push_back(to_string(imp.banner.w) + "x" + to_string(imp.banner.h));
     }
+    return slots;
+}
 
+// count a bid reply that did not arrive within tmax, once for each impression
+// of the request. It takes no part in the auction.
 
+void timedOut(Logger & logger, const string &bidder, const vector<string> &slots, const string &bidRequestId) {
+    for (auto &slot : slots) {
+        timeouts.add(bidder + " " + slot);
+    }
+    logger.information("TIMEOUT\t" + bidRequestId);
+}
+
+// stop sending events, then wait for the post-auction notices and print how
+// their delivery went
+
+void printNotices() {
+    events->stop();
+    notices->drain();
+    cout << "Notices: " << notices->queued() << " queued, " << notices->delivered() << " delivered, "
+            << notices->failed() << " failed, " << notices->dropped() << " dropped on a full queue" << endl;
+    cout << "  Delivery time: " << notices->deliveryTimes().summary() << endl;
+    cout << "  Billing notices: " << nbilling << ", loss notices: " << nlosses << ", " << notices->delayed()
+            << " held back for a delay" << endl;
+    if (notices->batching()) {
+        cout << "  Batches: " << notices->batches() << ", age when sent: " << notices->batchAges().summary() << endl;
+    }
+    for (auto &e : notices->endpoints()) {
+        cout << "  Endpoint " << e.endpoint << ": " << (e.up ? "up" : "down") << ", " << e.reconnects << " reconnects";
+        if (e.checks > 0)
+            cout << ", " << e.checks << " checks, " << e.failed << " failed, " << e.outages << " outages";
+        cout << endl;
+        cout << "    Delivery time: " << e.deliveryTimes->summary() << endl;
+    }
+    cout << "Events: " << events->scheduled() << " scheduled, " << events->sent() << " sent, "
+            << events->pending() << " not yet due, " << events->dropped() << " dropped on a full queue (deepest "
+            << events->maxDepth() << "), " << events->overflowed() << " dropped with memory full" << endl;
+    cout << "  Lateness: " << events->lateness().summary() << endl;
+    if (events->journal()) {
+        cout << "  Journal: " << events->replayed() << " picked up from the last run, " << events->journal()->used()
+                << " of " << events->journal()->capacity() << " records in use, " << events->spilled()
+                << " left to it while memory was full" << endl;
+    }
+    if (replay) {
+        cout << "Replay: " << replay->clicks() << " clicks and " << replay->conversions() << " conversions joined to wins, "
+                << replay->expired() << " logged without a win, at most " << replay->maxHeld() << " held at once" << endl;
+    }
 }
 
+void printTimeouts() {
+    for (auto &t : timeouts.snapshot()) {
+        cout << "Timeouts for " << t.first << ": " << t.second << endl;
+    }
+}
 
-// thread simulating sending clicks
+// run the auction on a bid reply and send a win notice for each bid that
+// wins. A reply may bid on several impressions, from several seats. Returns
+// the number of wins.
+
+int runAuction(Logger & logger, const Json::Value & bid, const vector<ImpressionObject> &imps, unsigned short winPort,
+        const string &winSite) {
+    // debug printout
+    //cerr << bid << endl;
+    logger.information("BID\t" + bid["id"].asString());
+
+    const string requestId{bid["id"].asString()};
+    int wins{0};
+    for (auto &seat : bid["seatbid"]) {
+        for (auto &b : seat["bid"]) {
+            // 50% chance to get a win, else someone outbid it
+            auto imp = find_if(imps.begin(), imps.end(), [&b](const ImpressionObject & i) {
+                return i.id == b["impid"].asString();
+            });
+            if (imp == imps.end())
+                continue;
+            if (rand100(generator) < 50) {
+                float winPrice = {b["price"].asFloat() * static_cast<float> (0.76)};
+                sendWin(logger, b["nurl"].asString(), b["burl"].asString(), macrosOf(requestId, bid, seat, b), *imp,
+                        winPrice, winPort, winSite);
+                ++wins;
+            } else {
+                sendLoss(logger, b["lurl"].asString(), macrosOf(requestId, bid, seat, b), b["price"].asFloat() * 1.1f,
+                        lossOutbid, winPort, winSite);
+            }
+        }
+    }
+    return wins;
+}
 
-void sendClicks() {
+// What to do with a bid request whose connection fails, from "retry":
+// {"attempts": n, "backoff": ms, "deadline": "original" or "fresh"}
+RetryPolicy readRetryPolicy() {
+    const Json::Value retry{configuration["retry"]};
+    const string deadline{retry.get("deadline", "original").asString()};
+    if (deadline != "original" && deadline != "fresh") {
+        throw runtime_error("Unknown retry deadline: " + deadline);
+    }
+    return RetryPolicy{retry.get("attempts", 1).asUInt(), chrono::milliseconds{retry.get("backoff", 10).asInt()},
+        deadline == "original"};
+}
 
-    vector<event> local_clicks{};
+// Whether to send a request again after its connection failed, and wait out
+// the backoff if so. A fresh deadline is tmax from the retry, but no later
+// than cutoff, when the auction is over.
+bool backOff(const RetryPolicy &policy, unsigned &attempt, chrono::steady_clock::time_point &deadline,
+        chrono::milliseconds tmax, chrono::steady_clock::time_point cutoff) {
+    if (attempt >= policy.attempts) {
+        return false;
+    }
+    const chrono::steady_clock::time_point at{chrono::steady_clock::now() + policy.backoff * (1 << min(attempt, 16u))};
+    if (!policy.keepDeadline) {
+        deadline = min(at + tmax, cutoff);
+    }
+    if (at >= deadline) {
+        return false;
+    }
+    this_thread::sleep_until(at);
+    ++attempt;
+    return true;
+}
 
-    cerr << "Starting sendClicks thread" << endl;
+// A bidder the auctions are sent to, with its own connection pool and tmax.
+// Without a "bidders" array in the configuration there is exactly one, made
+// from "site", "port", "winport" and "tmax".
+
+struct Bidder {
+    string name;
+    string host;
+    unsigned short winPort;
+    string winSite;             // win notices go over this socket if it is unix:/path
+    unique_ptr<RequestWriter> writer;
+    chrono::milliseconds tmax;
+    unique_ptr<HttpEngine> engine;
+
+    atomic<int> nrq{0};         // replies received in time
+    atomic<int> nbids{0};
+    atomic<int> nwins{0};
+    atomic<int> nfailed{0};
+    atomic<int> ndropped{0};
+    LatencyHistogram serviceTimes{};    // from request written to reply
+};
 
-    while (true) {
-        {
-            unique_lock<mutex> lck(mtx_clicks);
-            cv_clicks.wait_for(lck, chrono::duration<int>(10)); // wait 10 seconds
+// headers sent with every bid request
+const vector<pair<string, string>> openRtbHeaders{
+    {"x-openrtb-version", "2.0"}, // 2.0 is used by Smaato
+    {"x-openrtb-verbose", "1"} // request verbose reply
+};
 
-            local_clicks = std::move(clicks);
+vector<unique_ptr<Bidder>> readBidders(const chrono::milliseconds defaultTmax, const EngineOptions &defaults) {
+    Json::Value list{configuration["bidders"]};
+    if (list.isNull()) {
+        Json::Value single{};
+        single["site"] = configuration["site"];
+        single["port"] = configuration["port"];
+        list.append(single);
+    }
 
-            // remove all elements
-            // clicks.clear(); // not needed when moved!
-        }
+    vector<unique_ptr<Bidder>> bidders{};
+    for (auto &b : list) {
+        const string site{b["site"].asString()};
+        const Endpoint endpoint{endpointFor(site, static_cast<unsigned short> (b["port"].asInt()))};
+
+        EngineOptions options{defaults};
+        options.connections = b.get("connections", defaults.connections).asInt();
+        options.outstanding = b.get("outstanding", static_cast<Json::UInt> (defaults.outstanding)).asUInt();
+        options.pipeline = b.get("pipeline", static_cast<Json::UInt> (defaults.pipeline)).asUInt();
+
+        unique_ptr<Bidder> bidder{new Bidder{}};
+        bidder->name = b.get("name", endpoint.unixPath.empty() ? endpoint.host + ":" + to_string(endpoint.port) : site).asString();
+        bidder->host = endpoint.host;
+        bidder->winPort = static_cast<unsigned short> (b.get("winport", configuration["winport"]).asInt());
+        bidder->winSite = b.get("winsite", configuration["winsite"]).asString();
+        bidder->tmax = chrono::milliseconds{b.get("tmax", static_cast<Json::Int64> (defaultTmax.count())).asInt()};
+        bidder->writer.reset(new RequestWriter(endpoint.host, "/auctions", openRtbHeaders));
+        bidder->engine.reset(new HttpEngine(endpoint, options));
+        bidders.push_back(std::move(bidder));
+    }
+    return bidders;
+}
 
-        assert(clicks.empty());
+// Replies to one bid request that has been fanned out to every bidder
 
-        sleep(5); // sleep 5 seconds to make sure the win comes before the click
+struct Auction {
+    string id;
+    vector<string> slots;           // ad slot size of each impression
+    vector<ImpressionObject> imps;
+    chrono::steady_clock::time_point due;
+    vector<Json::Value> bids;       // one per bidder, null if it did not bid in time
+    atomic<size_t> remaining;       // bidders that have not replied or timed out yet
+};
 
-        if (false /* change to true for debug output */) {
-            if (!local_clicks.empty()) {
-                cout << "Sending: " << local_clicks.size() << " click events" << endl;
-                // empty entire queue
+// a bidder's highest bid on an impression in its reply, from any seat, or
+// null, and the seat it is in
 
-            } else {
-                cout << "No clicks to send..." << endl;
+const Json::Value *bidOn(const Json::Value &reply, const string &impId, const Json::Value *&bestSeat) {
+    const Json::Value *best{nullptr};
+    for (auto &seat : reply["seatbid"]) {
+        for (auto &bid : seat["bid"]) {
+            if (bid["impid"].asString() == impId && (!best || bid["price"].asFloat() > (*best)["price"].asFloat())) {
+                best = &bid;
+                bestSeat = &seat;
             }
         }
+    }
+    return best;
+}
 
-        for (auto & ev : local_clicks) {
-            //cerr << "Sending click on Id: " << ev.bidRequestId << endl;
-            sendPAEvent(ev.logger, ev.bidRequestId, ev.impId, "CLICK");
+// run the auction across the replies that arrived in time. With a "bidders"
+// array each impression is auctioned on its own: the highest bid on it at or
+// above its floor wins and pays the second highest bid (or the floor); the
+// others get a loss notice. A lone bidder from "site" and "port" wins by
+// chance as with the poco engine.
+
+void closeAuction(Logger & logger, Auction & auction, vector<unique_ptr<Bidder>> &bidders, bool single) {
+    if (single) {
+        if (!auction.bids[0].isNull()) {
+            bidders[0]->nwins += runAuction(logger, auction.bids[0], auction.imps, bidders[0]->winPort, bidders[0]->winSite);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < bidders.size(); ++i) {
+        if (!auction.bids[i].isNull())
+            logger.information("BID\t" + auction.id + "\t" + bidders[i]->name);
+    }
 
-            // for every click, enter a conversion with some probability
-            // 10% chance to get a conversion
-            if (rand100(generator) < 0) {
-                unique_lock<mutex> lck(mtx_conversions);
-                event ev2{0.0, ev.bidRequestId, ev.impId, "CONVERSION", ev.logger};
-                conversions.push_back(ev2);
+    vector<const Json::Value *> offers(bidders.size());
+    vector<const Json::Value *> seats(bidders.size());
+    for (auto &imp : auction.imps) {
+        const float bidfloor{imp.bidfloor};
+        int winner{-1};
+        float best{0.0};
+        float clearing{bidfloor};
+        for (size_t i = 0; i < bidders.size(); ++i) {
+            offers[i] = auction.bids[i].isNull() ? nullptr : bidOn(auction.bids[i], imp.id, seats[i]);
+            if (!offers[i])
+                continue;
+
+            float price{(*offers[i])["price"].asFloat()};
+            if (price < bidfloor)
+                continue;
+            if (winner < 0 || price > best) {
+                if (winner >= 0 && best > clearing)
+                    clearing = best;
+                winner = static_cast<int> (i);
+                best = price;
+            } else if (price > clearing) {
+                clearing = price;
+            }
+        }
+
+        for (size_t i = 0; i < bidders.size(); ++i) {
+            if (!offers[i])
+                continue;
+            const Json::Value &bid = *offers[i];
+            AuctionMacros macros{macrosOf(auction.id, auction.bids[i], *seats[i], bid)};
+            if (static_cast<int> (i) == winner) {
+                ++bidders[i]->nwins;
+                sendWin(logger, bid["nurl"].asString(), bid["burl"].asString(), std::move(macros), imp, clearing,
+                        bidders[i]->winPort, bidders[i]->winSite);
+            } else {
+                int reason{bid["price"].asFloat() < bidfloor ? lossBelowFloor : lossOutbid};
+                sendLoss(logger, bid["lurl"].asString(), std::move(macros), clearing, reason, bidders[i]->winPort,
+                        bidders[i]->winSite);
             }
         }
     }
 }
 
-// thread simulating sending conversions
+// the counters and latency histograms an agent reports to its controller
+
+Json::Value exchangeStats(int nauctions, const LatencyHistogram & auctionTimes, const vector<unique_ptr<Bidder>> &bidders) {
+    Json::Value stats{};
+    stats["auctions"] = nauctions;
+    stats["auctiontime"] = auctionTimes.toJson();
+    stats["bidders"] = Json::Value(Json::objectValue);
+    for (auto &b : bidders) {
+        Json::Value &bs = stats["bidders"][b->name];
+        bs["replies"] = b->nrq.load();
+        bs["bids"] = b->nbids.load();
+        bs["wins"] = b->nwins.load();
+        bs["failed"] = b->nfailed.load();
+        bs["dropped"] = b->ndropped.load();
+        bs["late"] = static_cast<Json::UInt64> (b->engine->lateResponses());
+        bs["retried"] = static_cast<Json::UInt64> (b->engine->retries());
+        bs["reconnects"] = static_cast<Json::UInt64> (b->engine->reconnects());
+        bs["givenup"] = static_cast<Json::UInt64> (b->engine->givenUp());
+        bs["service"] = b->serviceTimes.toJson();
+    }
+    stats["timeouts"] = Json::Value(Json::objectValue);
+    for (auto &t : timeouts.snapshot()) {
+        stats["timeouts"][t.first] = static_cast<Json::UInt64> (t.second);
+    }
+    Json::Value &es = stats["events"];
+    es["scheduled"] = static_cast<Json::UInt64> (events->scheduled());
+    es["sent"] = static_cast<Json::UInt64> (events->sent());
+    es["dropped"] = static_cast<Json::UInt64> (events->dropped());
+    es["depth"] = static_cast<Json::UInt64> (events->depth());
+    es["maxdepth"] = static_cast<Json::UInt64> (events->maxDepth());
+    return stats;
+}
 
-void sendConversions() {
-    vector<event> local_conversions{};
+// send the bid requests through the epoll engine instead of a single
+// HTTPClientSession, to every bidder at once. Many auctions are outstanding at
+// once and each reply is handled on one of the engines' reactor threads. By
+// default the next request goes out as soon as the bidders' windows of
+// outstanding requests have room (closed loop). With "arrival" set to
+// "constant" or "poisson" requests are issued at "qps" regardless of the
+// replies (open loop), and a request that finds a window full is dropped and
+// counted.
+// Each request's deadline is the bidder's tmax. A reply that has not arrived by
+// then is counted as a timeout and dropped, either abandoning the request
+// ("ontimeout": "abandon", the late reply is read and discarded as long as it
+// comes within "timeout" ms) or closing its connection ("abort").
+// Run as an agent, only the controller's share of the impression log is sent,
+// starting together with the other agents, and the stats are reported to the
+// controller as the run goes.
+
+int runEpollExchange(Logger & logger, const chrono::milliseconds defaultTmax, AgentLink * agent = nullptr) {
+    const string arrival{configuration.get("arrival", "closed").asString()};
+    if (arrival != "closed" && arrival != "constant" && arrival != "poisson") {
+        throw runtime_error("Unknown arrival process: " + arrival);
+    }
+    const string onTimeout{configuration.get("ontimeout", "abandon").asString()};
+    if (onTimeout != "abandon" && onTimeout != "abort") {
+        throw runtime_error("Unknown timeout policy: " + onTimeout);
+    }
 
-    cerr << "Starting sendConversion thread" << endl;
+    EngineOptions options{};
+    options.reactors = configuration.get("reactors", 2).asInt();
+    options.connections = configuration.get("connections", 64).asInt();
+    options.outstanding = configuration.get("outstanding", 1024).asUInt();
+    options.pipeline = configuration.get("pipeline", 1).asUInt();
+    options.onTimeout = onTimeout == "abort" ? TimeoutPolicy::Abort : TimeoutPolicy::Abandon;
+    options.linger = chrono::milliseconds{configuration.get("timeout", 1000).asInt()};
+    options.io = configuration.get("io", "epoll").asString() == "uring" ? IoBackend::Uring : IoBackend::Epoll;
+    options.retry = readRetryPolicy();
+
+    vector<unique_ptr<Bidder>> bidders{readBidders(defaultTmax, options)};
+    const bool single{configuration.get("bidders", Json::Value()).isNull()};  // one bidder that wins by chance
+    // an auction is over once the slowest bidder's tmax is up, and no retry
+    // with a fresh deadline runs past that
+    chrono::milliseconds longestTmax{0};
+    for (auto &b : bidders) {
+        longestTmax = max(longestTmax, b->tmax);
+    }
 
-    while (true) {
-        {
-            unique_lock<mutex> lck(mtx_conversions);
-            cv_conversions.wait_for(lck, chrono::duration<int>(95)); // wait 95 seconds
+    string bid_file{configuration["bids"].asString()};
+    ifstream bids{bid_file};
+    if (!bids.good()) {
+        throw runtime_error("Could not open bids file: " + bid_file);
+    }
 
-            if (false /* change to true for debug output */) {
-                if (!conversions.empty()) {
-                    cout << "Sending: " << conversions.size() << " conversion events" << endl;
-                    // empty entire queue
+    atomic<int> nauctions{0};
+    LatencyHistogram auctionTimes{};    // from request due to the last bidder's reply or timeout
+    Json::FastWriter jsonWriter{};      // renders bid requests without an intermediate stream
+
+    streamoff shareEnd{0};
+    mutex mtx_report;
+    condition_variable cv_report;
+    bool running{true};
+    thread reporter{};
+    if (agent) {
+        bids.seekg(agent->begin());
+        shareEnd = agent->end();
+        agent->ready();
+
+        const chrono::seconds interval{configuration["controller"].get("report", 1).asInt()};
+        reporter = thread([&] {
+            unique_lock<mutex> lck(mtx_report);
+            while (!cv_report.wait_for(lck, interval, [&] {
+                    return !running;
+                })) {
+                agent->report(exchangeStats(nauctions, auctionTimes, bidders), false);
+            }
+        });
+    }
 
-                } else {
-                    cout << "No conversions to send..." << endl;
-                }
+    // the schedule starts now, after the agents' common start
+    unique_ptr<ArrivalProcess> arrivals{};
+    if (arrival == "constant" || arrival == "poisson") {
+        arrivals.reset(new ArrivalProcess(configuration["qps"].asDouble(), arrival == "poisson"));
+    }
+
+    RequestSource source{bids, shareEnd, defaultTmax, configuration.get("coalesce", 1).asUInt()};
+    while (unique_ptr<BidRequest> next = source.next()) {
+        BidRequest &br = *next;
+        Json::Value brJson{br.toJson()};
+
+        shared_ptr<Auction> auction{make_shared<Auction>()};
+        auction->id = br.id;
+        auction->slots = slotNames(br);
+        for (auto &imp : br.imp) {
+            auction->imps.push_back(imp);
+        }
+        auction->due = arrivals ? arrivals->wait() : chrono::steady_clock::now();
+        auction->bids.resize(bidders.size());
+        auction->remaining = bidders.size();
+        ++nauctions;
+
+        // the bidder's part of the auction is over
+        auto settle = [&logger, &bidders, &auctionTimes, single](Auction & a) {
+            if (--a.remaining == 0) {
+                auctionTimes.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - a.due));
+                closeAuction(logger, a, bidders, single);
+            }
+        };
+
+        logger.information("BR\t" + br.id);
+        for (size_t i = 0; i < bidders.size(); ++i) {
+            Bidder &bidder = *bidders[i];
+            brJson["tmax"] = static_cast<Json::Int64> (bidder.tmax.count());
+
+            // the body goes out from where it is rendered, after its own head
+            string body{jsonWriter.write(brJson)};
+            HttpExchange ex{
+                bidder.writer->head(body.length()),
+                auction->due + bidder.tmax,
+                [&logger, &bidder, auction, i, settle](HttpResult & res) {
+                    // the deadline is checked on a 1 ms tick, so a reply can still be just too late
+                    if (res.timedOut || (res.status != 0 && res.latency > bidder.tmax)) {
+                        timedOut(logger, bidder.name, auction->slots, auction->id);
+                    } else if (res.status == 0) {
+                        ++bidder.nfailed;
+                    } else {
+                        ++bidder.nrq;
+                        bidder.serviceTimes.record(res.latency);
+                        if (res.status != 204) {
+                            Json::Reader reader{};
+                            if (reader.parse(res.body, auction->bids[i], false)) {
+                                ++bidder.nbids;
+                            } else {
+                                auction->bids[i] = Json::Value{};
+                                ++bidder.nfailed;
+                            }
+                        }
+                    }
+                    settle(*auction);
+                },
+                std::move(body),
+                auction->due + longestTmax
+            };
+
+            if (!arrivals) {
+                bidder.engine->submit(std::move(ex));
+            } else if (!bidder.engine->trySubmit(std::move(ex))) {
+                logger.information("DROP\t" + br.id + "\t" + bidder.name);
+                ++bidder.ndropped;
+                settle(*auction);
             }
+        }
+    }
+
+    for (auto &b : bidders) {
+        b->engine->drain();
+    }
 
-            local_conversions = std::move(conversions);
+    if (agent) {
+        {
+            lock_guard<mutex> lck(mtx_report);
+            running = false;
+        }
+        cv_report.notify_all();
+        reporter.join();
+        agent->report(exchangeStats(nauctions, auctionTimes, bidders), true);
+    }
 
-            // remove all elements
-            // conversions.clear(); // not needed when moved!
+    cout << "Auctions: " << nauctions << endl;
+    cout << "Auction time: " << auctionTimes.summary() << endl;
+    for (auto &b : bidders) {
+        cout << "Bidder " << b->name << ": " << b->nrq << " replies, " << b->nbids << " bids, " << b->nwins << " wins, "
+                << b->nfailed << " failed, " << b->engine->lateResponses() << " late replies discarded";
+        if (arrivals) {
+            cout << ", " << b->ndropped << " dropped on a full window";
         }
-        for (auto & ev : local_conversions) {
-            //cerr << "Sending conversion on Id: " << ev.bidRequestId << endl;
-            sendPAEvent(ev.logger, ev.bidRequestId, ev.impId, "CONVERSION");
+        cout << endl;
+        cout << "  Connections: " << b->engine->retries() << " requests retried, " << b->engine->givenUp()
+                << " failed after the last retry, " << b->engine->reconnects() << " reconnects" << endl;
+        cout << "  Service time: " << b->serviceTimes.summary() << endl;
+        for (auto &m : b->engine->malformedResponses()) {
+            cout << "  Malformed replies (" << m.first << "): " << m.second << endl;
         }
+        const chrono::microseconds cpu{b->engine->cpuTime()};
+        cout << "  Engine: " << (b->engine->backend() == IoBackend::Uring ? "io_uring" : "epoll") << ", "
+                << cpu.count() / 1000 << " ms CPU";
+        if (cpu.count() > 0)
+            cout << ", " << static_cast<long long> (b->nrq * 1e6 / cpu.count()) << " replies per CPU second";
+        cout << endl;
     }
+    printNotices();
+    printTimeouts();
+    cout << "My work is done..." << endl;
 
+    return 0;
+}
+
+// fire win notices, and the clicks and conversions the funnel model draws for
+// them, without any auctions: for the (bid id, imp id, price) lines of the
+// "tuples" file, or for "count" made up ones, at "qps" a second. The notices go
+// out in the same formats, and through the same dispatcher, as those of won
+// auctions, so the delivery times are printed per endpoint at the end.
+
+int runBlaster(Logger & logger) {
+    const Json::Value &conf = configuration["blaster"];
+    const string arrival{conf.get("arrival", "constant").asString()};
+    if (arrival != "constant" && arrival != "poisson") {
+        throw runtime_error("Unknown blaster arrival process: " + arrival);
+    }
+    const string winSite{configuration["winsite"].asString()};
+    const string nurl{conf.get("nurl", (isUnixSite(winSite) ? "http://localhost" : winSite)
+            + "/win/${AUCTION_ID}/${AUCTION_IMP_ID}/${AUCTION_PRICE}").asString()};
+    const string burl{conf.get("burl", "").asString()};
+    const unsigned short winPort{static_cast<unsigned short> (configuration["winport"].asInt())};
+
+    // a tab separated bid id, imp id and price per line, or made up ones
+    struct Tuple {
+        string bidId;
+        string impId;
+        float price;
+    };
+    vector<Tuple> tuples{};
+    if (conf.isMember("tuples")) {
+        ifstream in(conf["tuples"].asString());
+        if (!in) {
+            throw runtime_error("Cannot open blaster tuples: " + conf["tuples"].asString());
+        }
+        string line{};
+        while (getline(in, line)) {
+            istringstream fields(line);
+            Tuple t{};
+            if (getline(fields, t.bidId, '\t') && getline(fields, t.impId, '\t') && fields >> t.price)
+                tuples.push_back(t);
+        }
+        if (tuples.empty()) {
+            throw runtime_error("No tuples in " + conf["tuples"].asString());
+        }
+    }
+    // the tuples are sent over again until there have been count of them
+    const uint64_t count{conf.get("count", tuples.empty() ? 10000 : static_cast<Json::UInt64> (tuples.size())).asUInt64()};
+    const double minPrice{conf["price"].get("min", 0.5).asDouble()};
+    const double maxPrice{conf["price"].get("max", 5.0).asDouble()};
+    default_random_engine rng{};
+    uniform_real_distribution<double> price{minPrice, maxPrice};
+
+    // the events follow the funnel model, as they do for won auctions
+    const int segment{funnel->cellOf(0, 0, 0, 0, "")};
+
+    ArrivalProcess arrivals{conf.get("qps", 1000).asDouble(), arrival == "poisson"};
+    const auto start = chrono::steady_clock::now();
+    for (uint64_t n = 0; n < count; ++n) {
+        Tuple t{};
+        if (tuples.empty()) {
+            t = Tuple{"blast-" + to_string(n), "1", static_cast<float> (price(rng))};
+        } else {
+            t = tuples[n % tuples.size()];
+        }
+        ImpressionObject imp{t.impId, BannerObject{0, 0}};
+        imp.logId = t.bidId + "\t" + to_string(n / max<size_t>(tuples.size(), 1));
+        imp.segment = segment;
+        arrivals.wait();
+        sendWin(logger, nurl, burl, AuctionMacros{t.bidId, t.bidId, t.impId, "", "", "USD", "", t.price, 0.0, 0}, imp, t.price,
+                winPort, winSite);
+    }
+    const chrono::duration<double> took = chrono::steady_clock::now() - start;
+    cout << "Blaster: " << count << " win notices in " << took.count() << " s, "
+            << static_cast<uint64_t> (count / max(took.count(), 1e-9)) << " per second" << endl;
+
+    // the wins are in, give the events drawn for them up to linger seconds to go out
+    notices->drain();
+    const auto lingerUntil = chrono::steady_clock::now() + chrono::milliseconds{
+        static_cast<int64_t> (conf.get("linger", 0).asDouble() * 1000)};
+    while (events->pending() > 0 && chrono::steady_clock::now() < lingerUntil) {
+        this_thread::sleep_for(chrono::milliseconds{10});
+    }
+    printNotices();
+    return 0;
 }
 
 int main(int argc, char **argv) {
@@ -365,11 +1064,34 @@ int main(int argc, char **argv) {
     Json::Value latestBr{};
     Json::Value latestBr2{};
 
+    // the first argument may be a role, for coordinated runs over several processes
+    string role{};
+    int confArg{1};
+    if (argc > 1 && (string(argv[1]) == "controller" || string(argv[1]) == "agent" || string(argv[1]) == "mockbidder"
+            || string(argv[1]) == "blaster")) {
+        role = argv[1];
+        confArg = 2;
+    } else if (argc > 2 && string(argv[1]) == "bench") {
+        role = argv[1];
+        confArg = 3; // mockexchange bench <name> [conf.json]
+    }
+
     // read configuration file. If no command line argument is given, use rtb-adex.json
-    string const conf_file{(argc == 1 ? "rtb-adex.json" : argv[1])};
+    string const conf_file{(argc <= confArg ? "rtb-adex.json" : argv[confArg])};
     configuration = Json::Value(readConf(conf_file));
 
+    if (role == "controller") {
+        return runController(configuration);
+    } else if (role == "bench") {
+        return runBenchmark(argv[2], configuration);
+    } else if (role == "mockbidder") {
+        return runMockBidder(configuration);
+    }
+
     string lf{configuration["logfile"].asString()};
+    if (role == "agent") {
+        lf += "." + to_string(getpid()); // agents may share a host
+    }
     std::cerr << "Setting log file to " + lf << std::endl;
 
     AutoPtr<FileChannel> pChannel(new FileChannel);
@@ -399,17 +1121,109 @@ int main(int argc, char **argv) {
 
     const chrono::milliseconds defaultTmax{configuration["tmax"].asInt()};
 
-    // define and kick off the event threads
-    thread clickThread(sendClicks);
-    //	thread conversionThread(sendConversions);
+    const Json::Value &wins = configuration["wins"];
+    const Json::Value &batch = configuration["batch"];
+    const string batchFormat{batch.get("format", "array").asString()};
+    if (batchFormat != "array" && batchFormat != "ndjson") {
+        throw runtime_error("Unknown batch format: " + batchFormat);
+    }
+    // on every return from here on, and as a caught exception unwinds past it
+    ShutDownAtExit shutDownAtExit{};
+    notices.reset(new NoticeDispatcher(NoticeOptions{wins.get("connections", 4).asInt(), wins.get("queue", 1024).asUInt(),
+        chrono::milliseconds{wins.get("timeout", 1000).asInt()},
+        configuration.get("io", "epoll").asString() == "uring" ? IoBackend::Uring : IoBackend::Epoll,
+        batch.get("size", 1).asUInt(), chrono::milliseconds{batch.get("interval", 100).asInt()}, batchFormat == "ndjson",
+        chrono::milliseconds{wins["health"].get("interval", 0).asInt()}, wins["health"].get("path", "/health").asString()}));
+    smaatoWins = configuration["wnstyle"].asString() == "smaato";
+    eventsSite = configuration.get("eventssite", configuration["winsite"]).asString();
+    eventsHost = isUnixSite(eventsSite) ? "localhost" : URI(eventsSite).getHost();
+    eventsPort = static_cast<unsigned short> (configuration["eventsport"].asInt());
+    const Json::Value &cipher = configuration["pricecipher"];
+    const string scheme{cipher.get("scheme", "plain").asString()};
+    if (scheme == "hmac-sha1") {
+        const string encryptionKey{decodeWebSafeBase64(cipher["ekey"].asString())};
+        const string integrityKey{decodeWebSafeBase64(cipher["ikey"].asString())};
+        if (encryptionKey.empty() || integrityKey.empty()) {
+            throw runtime_error("The price cipher needs an ekey and an ikey in web safe base64");
+        }
+        priceCipher.reset(new PriceCipher(encryptionKey, integrityKey));
+    } else if (scheme != "plain") {
+        throw runtime_error("Unknown price cipher: " + scheme);
+    }
+    const Json::Value &billing = wins["billing"];
+    const Json::Value &loss = wins["loss"];
+    billingDelay.reset(new DelayDistribution(billing.get("distribution", "fixed").asString(),
+            billing.get("mean", 0).asDouble(), billing.get("sigma", 0.5).asDouble()));
+    lossDelay.reset(new DelayDistribution(loss.get("distribution", "fixed").asString(),
+            loss.get("mean", 0).asDouble(), loss.get("sigma", 0.5).asDouble()));
+
+    const Json::Value &eventsConf = configuration["events"];
+    const Json::Value &click = eventsConf["click"];
+    const Json::Value &conversion = eventsConf["conversion"];
+    clickDelay.reset(new DelayDistribution(click.get("distribution", "uniform").asString(),
+            click.get("mean", 10000).asDouble(), click.get("sigma", 0.5).asDouble()));
+    conversionDelay.reset(new DelayDistribution(conversion.get("distribution", "uniform").asString(),
+            conversion.get("mean", 95000).asDouble(), conversion.get("sigma", 0.5).asDouble()));
+    funnel.reset(new FunnelModel(configuration["funnel"]));
+    const Json::Value &replayConf = configuration["replay"];
+    if (!replayConf.isNull() && role == "blaster") {
+        // the blaster's wins have no impression log to join the logged events to
+        cerr << "replay is not used by the blaster: its clicks and conversions follow the funnel model" << endl;
+    } else if (!replayConf.isNull()) {
+        // a log is a file name or a list of them, in time order
+        auto files = [&replayConf](const char *name) {
+            vector<string> list{};
+            const Json::Value &v = replayConf[name];
+            if (v.isString()) {
+                list.push_back(v.asString());
+            } else {
+                for (auto &f : v) {
+                    list.push_back(f.asString());
+                }
+            }
+            return list;
+        };
+        replay.reset(new FunnelReplay(files("clicks"), files("conversions"),
+                chrono::milliseconds{replayConf.get("window", 3600000).asInt()}));
+        replaySpeedup = max(replayConf.get("speedup", 1).asInt(), 1);
+    }
+    unique_ptr<EventJournal> journal{};
+    if (eventsConf.isMember("journal")) {
+        journal.reset(new EventJournal(eventsConf["journal"].get("file", "events.journal").asString(),
+                static_cast<size_t> (eventsConf["journal"].get("size", 64).asUInt()) << 20));
+    }
+    events.reset(new EventScheduler(eventsConf.get("senders", 2).asInt(), eventsConf.get("queue", 4096).asUInt(),
+            eventsConf.get("memory", 1000000).asUInt(), [&logger](const ScheduledEvent & ev) {
+        sendPAEvent(logger, ev.bidRequestId, ev.impId, ev.type);
+    }, std::move(journal)));
 
     try {
 
+        if (role == "blaster") {
+            return runBlaster(logger);
+        } else if (role == "agent") {
+            AgentLink agent(configuration["controller"].get("host", "localhost").asString(),
+                    static_cast<unsigned short> (configuration["controller"].get("port", 7000).asInt()));
+            return runEpollExchange(logger, defaultTmax, &agent);
+        } else if (configuration["engine"].asString() == "epoll" || configuration.isMember("bidders")
+                || isUnixSite(configuration["site"].asString())) {
+            return runEpollExchange(logger, defaultTmax);
+        }
+
         // prepare session
         string uri_string = configuration["site"].asString();
         URI uri(uri_string);
-        HTTPClientSession session(uri.getHost(), configuration["port"].asInt());
+        const unsigned short port{static_cast<unsigned short> (configuration["port"].asInt())};
+        RawClientSession session(uri.getHost(), port);
         session.setKeepAlive(true);
+        const string bidder{uri.getHost() + ":" + configuration["port"].asString()};
+        const RequestWriter writer{port == 80 ? uri.getHost() : bidder, "/auctions", openRtbHeaders};
+        Json::FastWriter jsonWriter{};
+        const RetryPolicy retryPolicy{readRetryPolicy()};
+        const unsigned short winPort{static_cast<unsigned short> (configuration["winport"].asInt())};
+        const string winSite{configuration["winsite"].asString()};
+        int nretries{0};
+        int ndropped{0};
 
 
         string bid_file{configuration["bids"].asString()};
@@ -420,24 +1234,9 @@ int main(int argc, char **argv) {
 
         chrono::milliseconds accumulated_time{};
 
-        while (!bids.eof()) {
-            BidRequest br{defaultTmax};
-            bids >> br; // Construct a bid request, one line at a time
-
-            // filter all br that are not of format 300x50 or 300x250
-            int height = {br.imp[0].banner.h};
-            int width = {br.imp[0].banner.w};
-
-            if (width != 300) {
-                continue;
-            } else if ((height != 50) && (height != 250)) {
-                continue;
-            }
-
-            // set blocked categories 
-            br.bcat.push_back("IAB22");
-            // set fake operator
-            br.ext.carrierName = "personal";
+        RequestSource source{bids, 0, defaultTmax, configuration.get("coalesce", 1).asUInt()};
+        while (unique_ptr<BidRequest> next = source.next()) {
+            BidRequest &br = *next;
 
             // Now construct a JSON object out of the bid request object
             Json::Value brJson{br.toJson()};
@@ -448,146 +1247,137 @@ int main(int argc, char **argv) {
             //cerr << "Request: " << nrq << ":" << endl;
             //cerr << brJson << endl;
 
-            stringstream reqStream{};
-            reqStream << brJson;
-            string reqBody{reqStream.str()};
-
-            HTTPRequest request(HTTPRequest::HTTP_POST, "/auctions");
-            request.setKeepAlive(true);
+            const string reqBody{jsonWriter.write(brJson)};
 
-            request.setContentType("application/json");
+            // connecting may take up to tmax too
+            session.setTimeout(Poco::Timespan(0, static_cast<long> (br.tmax.count()) * 1000));
 
-
-            request.setContentLength(reqBody.length());
-            request.set("x-openrtb-version", "2.0"); // Sets openrtb version header 2.0 is used by Smaato
-            request.set("x-openrtb-verbose", "1"); // request verbose reply
-
-            bool failed{false};
+            // a request whose connection fails is sent again as the retry policy allows
+            unsigned attempt{0};
+            chrono::steady_clock::time_point deadline{chrono::steady_clock::now() + br.tmax};
+            const chrono::steady_clock::time_point cutoff{deadline};
+            bool again{false};
             do {
+                again = false;
+                bool lost{false};   // the connection failed before a reply was in
 
                 try {
-                    std::ostream& myOStream = session.sendRequest(request); // sends request, returns open stream
-                    if (!myOStream.good()) {
-                        session.reset();
-                        continue; // restart sending
+                    // header block and body in one system call
+                    if (!session.sendRaw(writer, reqBody)) {
+                        lost = true;
+                        throw Poco::Net::ConnectionResetException("could not send the bid request");
                     }
 
-
                     chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
 
-                    myOStream << reqBody; // sends the body
-                    if (!myOStream.good()) {
-                        session.reset();
-                        continue; // restart sending
-                    }
-
                     if (false /* change to true for debug output */) {
                         // for debug output
-                        request.write(std::cout);
-                        cout << "request body: " << reqBody << endl;
+                        cout << writer.render(reqBody) << endl;
                     }
 
                     logger.information("BR\t" + brJson["id"].asString());
 
-                    HTTPResponse res;
-                    istream &is = session.receiveResponse(res);
-                    if (!is.good()) {
-                        session.reset();
-                        continue; // restart sending
+                    // the bidder is cut off at tmax
+                    ParsedResponse res{};
+                    ParseResult error{ParseResult::Complete};
+                    const auto reply = session.receiveRaw(res, error, deadline);
+                    if (reply == RawClientSession::Reply::TimedOut) {
+                        // the session is in an unknown state
+                        timedOut(logger, bidder, slotNames(br), br.id);
+                        session.restart();
+                        ++nrestarts;
+                        continue;
+                    } else if (reply == RawClientSession::Reply::Closed) {
+                        cerr << "No message received. Restart connection..." << endl;
+                        lost = true;
+                    } else if (reply == RawClientSession::Reply::Malformed) {
+                        cerr << "Malformed bid reply (" << describe(error) << "). Restart connection..." << endl;
+                        lost = true;
                     }
 
-                    if (false /* change to true for debug output */)
-                        cout << res.getStatus() << " " << res.getReason() << endl;
-
-                    chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
-                    chrono::high_resolution_clock::duration responseTime = t2 - t1;
-                    chrono::milliseconds rt{chrono::duration_cast<chrono::milliseconds>(responseTime)};
-
-                    if (rt > defaultTmax) {
-                        cout << "Bid id: " << br.id << " arrived too late: " << rt.count() << " ms." << endl;
-                    }
+                    if (!lost) {
+                        if (false /* change to true for debug output */)
+                            cout << res.status << endl;
 
-                    // Get respons to Json Value
-                    Json::Value bid{};
-                    if (res.getStatus() != 204) {
-                        // This is a good bid, parse it and determine if it's a win
-                        is >> bid;
+                        chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+                        chrono::high_resolution_clock::duration responseTime = t2 - t1;
+                        chrono::milliseconds rt{chrono::duration_cast<chrono::milliseconds>(responseTime)};
 
-                        if (!is.good()) {
-                            session.reset();
-                            continue; // restart sending
+                        if (rt > br.tmax) {
+                            // too late to take part in the auction, skip the reply
+                            timedOut(logger, bidder, slotNames(br), br.id);
+                            continue;
                         }
 
-                        // debug printout
-                        //cerr << bid << endl;
-                        logger.information("BID\t" + bid["id"].asString());
-
-                        // 50% chance to get a win
-                        if (rand100(generator) < 50) {
-                            // find nurl, requestId, impId and winPrice
-                            string nurl{bid["seatbid"][0]["bid"][0]["nurl"].asString()};
-                            string requestId = {bid["id"].asString()};
-                            string impId = {bid["seatbid"][0]["bid"][0]["impid"].asString()};
-                            float winPrice = {bid["seatbid"][0]["bid"][0]["price"].asFloat() * static_cast<float> (0.76)};
-                            sendWin(logger, nurl, requestId, impId, winPrice);
+                        // Get respons to Json Value
+                        Json::Value bid{};
+                        if (res.status != 204) {
+                            // This is a good bid, parse it and determine if it's a win
+                            Json::Reader reader{};
+                            if (!reader.parse(res.body, res.body + res.bodyLength, bid, false)) {
+                                cerr << "Bid reply is not JSON. Restart connection..." << endl;
+                                lost = true;
+                            } else {
+                                runAuction(logger, bid, br.imp, winPort, winSite);
+                            }
                         }
 
+                        if (!lost) {
+                            if (false /* change to true for debug output */) {
+                                // print response
+                                if (!bid.empty())
+                                    cout << bid;
+                                cout << endl;
+                            }
+
+                            //cout << nrq << ": It took " << rt.count() << " ms to get bid back" << endl;
+                            accumulated_time += rt;
+                            ++nrq;
+                        }
                     }
-
-                    if (false /* change to true for debug output */) {
-                        // print response
-                        if (!bid.empty())
-                            cout << bid;
-                        //StreamCopier::copyStream(is, cout);
-                        cout << endl;
-                    }
-
-                    //cout << nrq << ": It took " << rt.count() << " ms to get bid back" << endl;
-                    accumulated_time += rt;
-                    ++nrq;
-                    failed = false;
                 }// end of try
- catch (const Poco::Net::NoMessageException &noMsgEx) {
-                    std::cerr << "No message received. Restart connection..." << std::endl;
-                    session.reset();
+ catch (const Poco::TimeoutException &timeoutEx) {
+                    // could not even connect within tmax
+                    timedOut(logger, bidder, slotNames(br), br.id);
+                    session.restart();
+                    ++nrestarts;
                     continue;
-                } catch (const Poco::Net::ConnectionResetException &netEx) {
-                    std::string errstr = {"Socket Error : " + netEx.displayText()};
-                    std::cerr << errstr << std::endl;
-                    break;
-                } catch (const Poco::Net::ConnectionRefusedException &netEx) {
-
-                    std::string errstr = {"Socket Error : " + netEx.displayText()};
-                    std::cerr << errstr << std::endl;
-                    break;
-                } catch (const Poco::Net::ConnectionAbortedException &netEx) {
-                    std::string errstr = {"Socket Error : " + netEx.displayText()};
-                    std::cerr << "Msg forward failed: " << errstr << std::endl;
-                    break;
+                } catch (const Poco::Net::NetException &netEx) {
+                    // reset, refused or aborted
+                    if (!lost) {
+                        cerr << "Socket Error : " << netEx.displayText() << endl;
+                        lost = true;
+                    }
                 }
  catch (const Exception &ex) {
-                    if (strncmp(ex.name(), "No message received", 19) == 0) {
-                        //cerr << ex.displayText() << endl;
-                        cerr << "restart connection..." << endl;
-                        ++nrestarts;
-                        session.reset();
-                        continue;
+                    cerr << ex.displayText() << endl;
+                    lost = true;
+                }
+
+                if (lost) {
+                    session.restart();
+                    ++nrestarts;
+                    again = backOff(retryPolicy, attempt, deadline, br.tmax, cutoff);
+                    if (again) {
+                        ++nretries;
                     } else {
-                        cerr << ex.displayText() << endl;
-                        cout << "Time for bid reply on average: " << accumulated_time.count() / nrq << " ms over " << nrq << " bid requests sent." << endl;
-                        cout << "Number of restarts:" << nrestarts << endl;
-                        return -1;
+                        // out of retries, or a retry could not make the deadline
+                        ++ndropped;
+                        logger.information("DROP\t" + br.id);
                     }
                 }
-
-            } while (failed);
+            } while (again);
 
             //session.reset();
 
         }
 
 
-        cout << "Time for bid reply on average: " << accumulated_time.count() / nrq << " ms over " << nrq << " bid requests sent." << endl;
+        cout << "Time for bid reply on average: " << accumulated_time.count() / max(nrq, 1) << " ms over " << nrq << " bid requests sent." << endl;
+        cout << "Connection: " << nretries << " requests retried, " << ndropped << " failed after the last retry, "
+                << nrestarts << " reconnects" << endl;
+        printNotices();
+        printTimeouts();
         cout << "My work is done..." << endl;
 
     } catch (Exception &ex) {
@@ -0,0 +1,619 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "mock_bidder.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <queue>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <csignal>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "http_engine.h"
+#include "arrival.h"
+#include "price_cipher.h"
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const string noContent{"HTTP/1.1 204 No Content\r\n\r\n"};
+const string ok{"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"};
+
+// A listening socket and the traffic it takes. When ports are shared, bid
+// requests are told apart by their /auctions path and wins by /wins. Billing
+// and loss notices come to the win port as /billing and /losses.
+struct Listener {
+    int fd;
+    string name;
+    bool bids;
+    bool wins;
+    bool events;
+};
+
+struct Counters {
+    atomic<uint64_t> requests{0};   // bid requests
+    atomic<uint64_t> bids{0};
+    atomic<uint64_t> wins{0};
+    atomic<uint64_t> billing{0};
+    atomic<uint64_t> losses{0};
+    atomic<uint64_t> badPrices{0};  // encrypted win prices that did not decrypt
+    atomic<uint64_t> events{0};
+    atomic<uint64_t> connections{0};
+};
+
+// How the bidder answers: how often it bids, what it bids, how big the
+// reply is and how long it takes
+class BidModel {
+public:
+    BidModel(const Json::Value &conf, const string &winHost, unsigned short winPort, const Json::Value &cipher)
+    : delay{conf["latency"].get("distribution", "fixed").asString(), conf["latency"].get("mean", 0.0).asDouble(),
+        conf["latency"].get("sigma", 0.5).asDouble()}
+    {
+        bidRate = conf.get("bidrate", 1.0).asDouble();
+        size = conf.get("size", 0).asUInt();
+        minPrice = conf["price"].get("min", 0.5).asDouble();
+        maxPrice = conf["price"].get("max", 5.0).asDouble();
+        nurl = "http://" + winHost + "/wins/${AUCTION_ID}/${AUCTION_IMP_ID}/${AUCTION_PRICE}";
+        const string base{"http://" + winHost + ":" + to_string(winPort)};
+        if (conf.get("burl", false).asBool())
+            notices += ",\"burl\":\"" + base + "/billing/${AUCTION_ID}/${AUCTION_IMP_ID}/${AUCTION_PRICE}\"";
+        if (conf.get("lurl", false).asBool())
+            notices += ",\"lurl\":\"" + base + "/losses/${AUCTION_ID}/${AUCTION_IMP_ID}?reason=${AUCTION_LOSS}\"";
+        if (cipher.get("scheme", "plain").asString() == "hmac-sha1") {
+            priceCipher.reset(new PriceCipher(decodeWebSafeBase64(cipher["ekey"].asString()),
+                    decodeWebSafeBase64(cipher["ikey"].asString())));
+        }
+    }
+
+    bool decrypts() const {
+        return priceCipher != nullptr;
+    }
+
+    // whether the price at the end of a win notice's path decrypts, as a
+    // bidder would check it
+    bool priceValid(const char *path, const char *end) const {
+        const char *last{path};
+        const char *p{path};
+        for (; p < end && *p != ' ' && *p != '?'; ++p) {
+            if (*p == '/')
+                last = p + 1;
+        }
+        uint64_t micros{0};
+        return priceCipher->decrypt(string(last, p), micros);
+    }
+
+    bool bids(mt19937_64 &rng) const {
+        return uniform_real_distribution<double>(0.0, 1.0)(rng) < bidRate;
+    }
+
+    // time from a bid request being read until its reply is due
+    Clock::duration latency(mt19937_64 &rng) const {
+        return delay.draw(rng);
+    }
+
+    // a complete 200 reply bidding on each impression, padded to size bytes
+    string reply(const string &id, const vector<string> &impIds, mt19937_64 &rng) const {
+        string body{"{\"id\":\"" + id + "\",\"seatbid\":[{\"bid\":["};
+        for (size_t i = 0; i < impIds.size(); ++i) {
+            char price[32];
+            snprintf(price, sizeof (price), "%.4f", uniform_real_distribution<double>(minPrice, maxPrice)(rng));
+            body += (i > 0 ? ",{\"id\":\"" : "{\"id\":\"") + to_string(i + 1) + "\",\"impid\":\"" + impIds[i]
+                    + "\",\"price\":" + price + ",\"nurl\":\"" + nurl + "\"" + notices + "}";
+        }
+        body += "],\"ext\":{\"pad\":\"";
+        const size_t tail{5};  // the closing quote and }}]}
+        if (body.length() + tail < size)
+            body.append(size - body.length() - tail, 'x');
+        body += "\"}}]}";
+        return "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + to_string(body.length())
+                + "\r\n\r\n" + body;
+    }
+
+private:
+    double bidRate;
+    size_t size;
+    double minPrice;
+    double maxPrice;
+    const DelayDistribution delay;
+    string nurl;
+    string notices;     // the burl and lurl, if the bids carry them
+    unique_ptr<PriceCipher> priceCipher;
+};
+
+// Read the top level "id" and the impressions' "id"s out of a bid request
+// without building the whole JSON tree
+void scanIds(const char *p, const char *end, string &id, vector<string> &impIds) {
+    int depth{0};
+    string keys[4];
+    while (p < end) {
+        const char ch{*p++};
+        if (ch == '{' || ch == '[') {
+            ++depth;
+            if (depth < 4)
+                keys[depth].clear();
+        } else if (ch == '}' || ch == ']') {
+            --depth;
+        } else if (ch == '"') {
+            const char *start{p};
+            while (p < end && *p != '"') {
+                if (*p == '\\')
+                    ++p;
+                ++p;
+            }
+            const string s(start, min(p, end));
+            ++p;
+            const char *q{p};
+            while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n'))
+                ++q;
+            if (q < end && *q == ':') {
+                if (depth < 4)
+                    keys[depth] = s;
+            } else if (depth == 1 && keys[1] == "id") {
+                id = s;
+            } else if (depth == 3 && keys[1] == "imp" && keys[3] == "id") {
+                impIds.push_back(s);
+            }
+        }
+    }
+}
+
+// the notices in a win or event body: one JSON object, an array of them or
+// newline delimited ones (and one for a GET without a body)
+uint64_t countNotices(const char *p, const char *end) {
+    uint64_t n{0};
+    int depth{0};
+    const int top{p < end && *p == '[' ? 1 : 0};
+    for (; p < end; ++p) {
+        if (*p == '"') {
+            while (++p < end && *p != '"') {
+                if (*p == '\\')
+                    ++p;
+            }
+        } else if (*p == '{' || *p == '[') {
+            if (*p == '{' && depth == top)
+                ++n;
+            ++depth;
+        } else if (*p == '}' || *p == ']') {
+            --depth;
+        }
+    }
+    return max<uint64_t>(n, 1);
+}
+
+// the value of a request header, or empty
+string header(const char *head, const char *end, const char *name) {
+    const size_t n{strlen(name)};
+    for (const char *p = head; p + n + 2 < end; ++p) {
+        if (p[0] == '\r' && p[1] == '\n' && strncasecmp(p + 2, name, n) == 0 && p[n + 2] == ':') {
+            const char *v{p + n + 3};
+            while (v < end && *v == ' ')
+                ++v;
+            const char *e{v};
+            while (e < end && *e != '\r')
+                ++e;
+            return string(v, e);
+        }
+    }
+    return string();
+}
+
+struct Connection {
+    int fd;
+    const Listener *listener;
+    string in;
+    string out;
+    deque<pair<Clock::time_point, string>> replies;     // not yet due, in request order
+    bool closing{false};    // the client asked to close after the reply
+    bool wantWrite{false};
+};
+
+// One epoll loop serving connections from all listeners. Replies that have
+// a latency wait on a timer, and each connection answers in request order.
+class Worker {
+public:
+    Worker(const vector<Listener> &listeners, const BidModel &model, const string &healthPath, Counters &counters)
+    : listeners(listeners), model(model), healthPath(healthPath), counters(counters), stopping{false}, nextId{firstConnection},
+    rng{random_device{}()} {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd < 0 || wakefd < 0) {
+            throw runtime_error("Could not set up epoll: " + string(strerror(errno)));
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = wakeId;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+        for (size_t i = 0; i < listeners.size(); ++i) {
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE; // one worker takes each new connection
+            ev.data.u64 = i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev);
+        }
+        worker = thread(&Worker::run, this);
+    }
+
+    ~Worker() {
+        stopping = true;
+        uint64_t one{1};
+        if (::write(wakefd, &one, sizeof (one)) < 0) {
+            // an eventfd that is never read does not fill up from one write
+        }
+        worker.join();
+        for (auto &c : conns) {
+            ::close(c.second.fd);
+        }
+        ::close(wakefd);
+        ::close(epfd);
+    }
+
+private:
+    static const uint64_t wakeId{~uint64_t{0}};
+    static const uint64_t firstConnection{uint64_t{1} << 32};
+
+    void run() {
+        epoll_event events[256];
+        while (!stopping) {
+            int timeout{-1};
+            if (!timers.empty()) {
+                const auto wait = chrono::duration_cast<chrono::microseconds> (timers.top().first - Clock::now());
+                timeout = static_cast<int> (max<long long>(0, (wait.count() + 999) / 1000));
+            }
+            const int n{epoll_wait(epfd, events, 256, timeout)};
+            for (int i = 0; i < n; ++i) {
+                const uint64_t id{events[i].data.u64};
+                if (id == wakeId) {
+                    continue;
+                } else if (id < listeners.size()) {
+                    accept(listeners[id]);
+                } else {
+                    auto it = conns.find(id);
+                    if (it == conns.end())
+                        continue;
+                    if ((events[i].events & EPOLLOUT) && !flush(id, it->second))
+                        continue;
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                        receive(id, it->second);
+                }
+            }
+
+            const Clock::time_point now{Clock::now()};
+            while (!timers.empty() && timers.top().first <= now) {
+                const uint64_t id{timers.top().second};
+                timers.pop();
+                auto it = conns.find(id);
+                if (it == conns.end())
+                    continue;
+                Connection &c = it->second;
+                while (!c.replies.empty() && c.replies.front().first <= now) {
+                    c.out += c.replies.front().second;
+                    c.replies.pop_front();
+                }
+                flush(id, c);
+            }
+        }
+    }
+
+    void accept(const Listener &l) {
+        for (;;) {
+            int fd = accept4(l.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            int one{1};
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one)); // fails harmlessly on unix sockets
+            const uint64_t id{nextId++};
+            Connection &c = conns[id];
+            c.fd = fd;
+            c.listener = &l;
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = id;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            ++counters.connections;
+        }
+    }
+
+    void receive(uint64_t id, Connection &c) {
+        char buf[65536];
+        bool eof{false};
+        for (;;) {
+            const ssize_t n{recv(c.fd, buf, sizeof (buf), 0)};
+            if (n > 0) {
+                c.in.append(buf, n);
+                if (static_cast<size_t> (n) < sizeof (buf))
+                    break;
+            } else {
+                eof = n == 0 || (errno != EAGAIN && errno != EINTR);
+                break;
+            }
+        }
+
+        // answer every complete request in the buffer
+        const Clock::time_point now{Clock::now()};
+        size_t used{0};
+        for (;;) {
+            const size_t eoh{c.in.find("\r\n\r\n", used)};
+            if (eoh == string::npos)
+                break;
+            const char *head{c.in.data() + used};
+            const char *headEnd{c.in.data() + eoh + 2};
+            const size_t length{strtoul(header(head, headEnd, "Content-Length").c_str(), nullptr, 10)};
+            if (c.in.length() < eoh + 4 + length)
+                break;
+            if (strncasecmp(header(head, headEnd, "Connection").c_str(), "close", 5) == 0)
+                c.closing = true;
+            const char *path{static_cast<const char *> (memchr(head, ' ', headEnd - head))};
+            path = path ? path + 1 : headEnd;
+            const char *body{c.in.data() + eoh + 4};
+            answer(id, c, path, body, body + length, now);
+            used = eoh + 4 + length;
+        }
+        c.in.erase(0, used);
+
+        if (eof) {
+            close(id, c);
+        } else {
+            flush(id, c);
+        }
+    }
+
+    void answer(uint64_t id, Connection &c, const char *path, const char *body, const char *end, Clock::time_point now) {
+        const Listener &l = *c.listener;
+        Clock::time_point due{now};
+        string reply{};
+        if (l.bids && (strncmp(path, "/auctions", 9) == 0 || !(l.wins || l.events))) {
+            ++counters.requests;
+            due += model.latency(rng);
+            if (model.bids(rng)) {
+                string requestId{};
+                vector<string> impIds{};
+                scanIds(body, end, requestId, impIds);
+                reply = model.reply(requestId, impIds, rng);
+                ++counters.bids;
+            } else {
+                reply = noContent;
+            }
+        } else if (strncmp(path, healthPath.c_str(), healthPath.length()) == 0) {
+            reply = ok; // the exchange checking on its notice endpoints
+        } else if (l.wins && strncmp(path, "/billing", 8) == 0) {
+            ++counters.billing;
+            reply = ok;
+        } else if (l.wins && strncmp(path, "/losses", 7) == 0) {
+            ++counters.losses;
+            reply = ok;
+        } else {
+            if (l.wins && (strncmp(path, "/wins", 5) == 0 || !l.events)) {
+                counters.wins += countNotices(body, end);
+                if (model.decrypts() && body == end && !model.priceValid(path, body))
+                    ++counters.badPrices;
+            }
+            else
+                counters.events += countNotices(body, end);
+            reply = ok;
+        }
+
+        // replies go out in request order, a quick one waits for a slow one before it
+        if (!c.replies.empty() && due < c.replies.back().first)
+            due = c.replies.back().first;
+        if (c.replies.empty() && due <= now) {
+            c.out += reply;
+        } else {
+            c.replies.emplace_back(due, std::move(reply));
+            timers.emplace(due, id);
+        }
+    }
+
+    // write what is due. Returns false if the connection was closed.
+    bool flush(uint64_t id, Connection &c) {
+        while (!c.out.empty()) {
+            const ssize_t n{::send(c.fd, c.out.data(), c.out.length(), MSG_NOSIGNAL)};
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+                close(id, c);
+                return false;
+            }
+            c.out.erase(0, n);
+        }
+        if (c.out.empty() && c.replies.empty() && c.closing) {
+            close(id, c);
+            return false;
+        }
+        const bool write{!c.out.empty()};
+        if (write != c.wantWrite) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP | (write ? static_cast<uint32_t> (EPOLLOUT) : 0u);
+            ev.data.u64 = id;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+            c.wantWrite = write;
+        }
+        return true;
+    }
+
+    void close(uint64_t id, Connection &c) {
+        ::close(c.fd);
+        conns.erase(id);
+    }
+
+    const vector<Listener> &listeners;
+    const BidModel &model;
+    const string healthPath;    // not counted as a notice
+    Counters &counters;
+    atomic<bool> stopping;
+    int epfd;
+    int wakefd;
+
+    // the members below are only touched by the worker thread
+    uint64_t nextId;
+    map<uint64_t, Connection> conns;
+    priority_queue<pair<Clock::time_point, uint64_t>, vector<pair<Clock::time_point, uint64_t>>,
+            greater<pair<Clock::time_point, uint64_t>>> timers;
+    mt19937_64 rng;
+
+    thread worker;
+};
+
+int listenOn(const string &site, unsigned short port, const string &host) {
+    int fd{-1};
+    if (isUnixSite(site)) {
+        const string path{site.substr(5)};
+        sockaddr_un addr{};
+        if (path.length() >= sizeof (addr.sun_path)) {
+            throw runtime_error("Unix socket path too long: " + path);
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+        ::unlink(path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) < 0 || ::listen(fd, 1024) < 0) {
+            throw runtime_error("Could not listen on " + path + ": " + strerror(errno));
+        }
+        return fd;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        throw runtime_error("Not an IPv4 address to listen on: " + host);
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one{1};
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one)) < 0
+            || ::bind(fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) < 0 || ::listen(fd, 1024) < 0) {
+        throw runtime_error("Could not listen on port " + to_string(port) + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// the host part of a site such as http://host:port/path
+string hostOf(const string &site) {
+    size_t begin{site.find("://")};
+    begin = begin == string::npos ? 0 : begin + 3;
+    const size_t end{site.find_first_of(":/", begin)};
+    return site.substr(begin, end == string::npos ? string::npos : end - begin);
+}
+
+} // namespace
+
+int runMockBidder(const Json::Value &configuration) {
+    const Json::Value &conf = configuration["mockbidder"];
+    const string host{conf.get("host", "127.0.0.1").asString()};
+
+    // the endpoints the exchange sends to, merged where they are the same
+    struct Endpoint {
+        string site;
+        unsigned short port;
+        bool bids, wins, events;
+    };
+    const string winSite{configuration["winsite"].asString()};
+    const Endpoint wanted[] = {
+        {configuration["site"].asString(), static_cast<unsigned short> (configuration["port"].asInt()), true, false, false},
+        {winSite, static_cast<unsigned short> (configuration["winport"].asInt()), false, true, false},
+        {configuration.get("eventssite", winSite).asString(), static_cast<unsigned short> (configuration["eventsport"].asInt()),
+            false, false, true}
+    };
+    vector<Listener> listeners{};
+    for (auto &e : wanted) {
+        const string name{isUnixSite(e.site) ? e.site : host + ":" + to_string(e.port)};
+        if (!isUnixSite(e.site) && e.port == 0)
+            continue;
+        bool merged{false};
+        for (auto &l : listeners) {
+            if (l.name == name) {
+                l.bids |= e.bids;
+                l.wins |= e.wins;
+                l.events |= e.events;
+                merged = true;
+            }
+        }
+        if (!merged)
+            listeners.push_back(Listener{listenOn(e.site, e.port, host), name, e.bids, e.wins, e.events});
+    }
+    if (listeners.empty() || !listeners[0].bids) {
+        throw runtime_error("No port or unix socket to serve bid requests on");
+    }
+
+    const BidModel model{conf, isUnixSite(winSite) || winSite.empty() ? "localhost" : hostOf(winSite),
+        static_cast<unsigned short> (configuration["winport"].asInt()), configuration["pricecipher"]};
+    const string healthPath{configuration["wins"]["health"].get("path", "/health").asString()};
+    Counters counters{};
+
+    // the workers' threads inherit the blocked signals, so only sigtimedwait below sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    const int nthreads{max(1, conf.get("threads", 1).asInt())};
+    vector<unique_ptr<Worker>> workers{};
+    for (int i = 0; i < nthreads; ++i) {
+        workers.emplace_back(new Worker(listeners, model, healthPath, counters));
+    }
+    for (auto &l : listeners) {
+        cout << "Serving " << (l.bids ? "bids " : "") << (l.wins ? "wins " : "") << (l.events ? "events " : "")
+                << "on " << l.name << endl;
+    }
+
+    const int report{max(1, conf.get("report", 1).asInt())};
+    const int duration{conf.get("duration", 0).asInt()};
+    const auto t0 = Clock::now();
+    uint64_t lastRequests{0};
+    for (;;) {
+        const timespec wait{report, 0};
+        const bool interrupted{sigtimedwait(&signals, nullptr, &wait) > 0};
+        const auto elapsed = chrono::duration_cast<chrono::seconds> (Clock::now() - t0);
+        const uint64_t requests{counters.requests.load()};
+        cout << "[" << setw(4) << elapsed.count() << " s] " << requests << " bid requests ("
+                << (requests - lastRequests) / report << "/s), " << counters.bids << " bids, " << counters.wins << " wins, "
+                << counters.billing << " billing, " << counters.losses << " losses, " << counters.events << " events, "
+                << counters.connections << " connections";
+        if (model.decrypts())
+            cout << ", " << counters.badPrices << " bad prices";
+        cout << endl;
+        lastRequests = requests;
+        if (interrupted || (duration > 0 && elapsed.count() >= duration))
+            break;
+    }
+
+    workers.clear();
+    for (auto &l : listeners) {
+        ::close(l.fd);
+        if (isUnixSite(l.name))
+            ::unlink(l.name.substr(5).c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// A local bidder to run the exchange against, started with
+// "mockexchange mockbidder [conf.json]". It serves bid requests on "site" and
+// "port", win notices on "winsite" and "winport" and events on "eventssite"
+// and "eventsport" from the same configuration file the exchange uses, so
+// the two meet without any other services. How it bids is set up by the
+// "mockbidder" section.
+
+#pragma once
+
+#include "json/json.h"
+
+// Serve until interrupted (or for "duration" seconds). Returns the process exit code.
+int runMockBidder(const Json::Value &configuration);
@@ -0,0 +1,125 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Bounded lock-free queue for many producers and a single consumer, after
+// Dmitry Vyukov's bounded queue. Every cell carries a sequence number that
+// tells a producer whether the cell is free and the consumer whether it has
+// been filled, so producers only contend on the tail and the consumer never
+// takes a lock. A push to a full queue fails instead of waiting.
+template <typename T>
+class MpscQueue {
+public:
+    // the capacity is rounded up to a power of two
+    explicit MpscQueue(size_t capacity)
+    : mask{roundUp(capacity) - 1}, cells(new Cell[mask + 1]), tail{0}, head{0}
+    {
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // any thread. Returns false if the queue is full.
+    bool tryPush(T &&item) {
+        size_t pos{tail.load(std::memory_order_relaxed)};
+        Cell *cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            const size_t seq{cell->seq.load(std::memory_order_acquire)};
+            const intptr_t dif{static_cast<intptr_t> (seq) - static_cast<intptr_t> (pos)};
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false; // the consumer has not taken this cell's last item yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->item = std::move(item);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only. Hand up to max items to f, oldest first, and return how
+    // many there were.
+    template <typename F>
+    size_t drain(F f, size_t max) {
+        size_t pos{head.load(std::memory_order_relaxed)};
+        size_t n{0};
+        for (; n < max; ++n, ++pos) {
+            Cell &cell = cells[pos & mask];
+            if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+                break;
+            f(std::move(cell.item));
+            cell.item = T{};
+            cell.seq.store(pos + mask + 1, std::memory_order_release);
+        }
+        head.store(pos, std::memory_order_relaxed);
+        return n;
+    }
+
+    // consumer only
+    bool empty() const {
+        const size_t pos{head.load(std::memory_order_relaxed)};
+        return cells[pos & mask].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    // items pushed and not yet taken, approximate while others push
+    size_t depth() const {
+        const size_t h{head.load(std::memory_order_relaxed)};
+        const size_t t{tail.load(std::memory_order_relaxed)};
+        return t > h ? t - h : 0;
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    static size_t roundUp(size_t n) {
+        size_t p{2};
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+
+    // The producers' tail and the consumer's head get a cache line each. This
+    // uses padding rather than alignas, because before C++17 new does not align
+    // a queue that lives on the heap.
+    static const size_t cacheLine{64};
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    char padTail[cacheLine];
+    std::atomic<size_t> tail;   // next cell to push to, shared by the producers
+    char padHead[cacheLine - sizeof (std::atomic<size_t>)];
+    std::atomic<size_t> head;   // next cell to take from, written by the consumer only
+    char padEnd[cacheLine - sizeof (std::atomic<size_t>)];
+};
@@ -35,10 +35,39 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
+	${OBJECTDIR}/arrival.o \
 	${OBJECTDIR}/aux_info.o \
+	${OBJECTDIR}/bench.o \
+	${OBJECTDIR}/control.o \
+	${OBJECTDIR}/event_journal.o \
+	${OBJECTDIR}/event_scheduler.o \
+	${OBJECTDIR}/funnel_model.o \
+	${OBJECTDIR}/funnel_replay.o \
+	${OBJECTDIR}/http_engine.o \
 	${OBJECTDIR}/jsoncpp.o \
-	${OBJECTDIR}/main.o
-
+	${OBJECTDIR}/main.o \
+	${OBJECTDIR}/mock_bidder.o \
+	${OBJECTDIR}/notice_dispatcher.o \
+	${OBJECTDIR}/price_cipher.o \
+	${OBJECTDIR}/request_writer.o \
+	${OBJECTDIR}/response_parser.o \
+	${OBJECTDIR}/stats.o \
+	${OBJECTDIR}/uring_reactor.o \
+	${OBJECTDIR}/url_template.o
+
+
+# Test Directory
+TESTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}/tests
+
+# Test Files
+TESTFILES= \
+	${TESTDIR}/TestFiles/f1 \
+	${TESTDIR}/TestFiles/f2
+
+# Test Object Files
+TESTOBJECTFILES= \
+	${TESTDIR}/tests/event_journal_test.o \
+	${TESTDIR}/tests/url_template_test.o
 
 # C Compiler Flags
 CFLAGS=
@@ -54,7 +83,7 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=-lPocoFoundationd -lPocoNetd -lpthread
+LDLIBSOPTIONS=-lPocoFoundationd -lPocoNetd -lpthread -lz
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
@@ -79,9 +108,122 @@ ${OBJECTDIR}/main.o: main.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/main.o main.cpp
 
+${OBJECTDIR}/http_engine.o: http_engine.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/http_engine.o http_engine.cpp
+
+${OBJECTDIR}/stats.o: stats.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/stats.o stats.cpp
+
+${OBJECTDIR}/arrival.o: arrival.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/arrival.o arrival.cpp
+
+${OBJECTDIR}/control.o: control.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/control.o control.cpp
+
+${OBJECTDIR}/bench.o: bench.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/bench.o bench.cpp
+
+${OBJECTDIR}/uring_reactor.o: uring_reactor.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/uring_reactor.o uring_reactor.cpp
+
+${OBJECTDIR}/request_writer.o: request_writer.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/request_writer.o request_writer.cpp
+
+${OBJECTDIR}/response_parser.o: response_parser.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/response_parser.o response_parser.cpp
+
+${OBJECTDIR}/mock_bidder.o: mock_bidder.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/mock_bidder.o mock_bidder.cpp
+
+${OBJECTDIR}/notice_dispatcher.o: notice_dispatcher.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/notice_dispatcher.o notice_dispatcher.cpp
+
+${OBJECTDIR}/event_scheduler.o: event_scheduler.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/event_scheduler.o event_scheduler.cpp
+
+${OBJECTDIR}/funnel_replay.o: funnel_replay.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/funnel_replay.o funnel_replay.cpp
+
+${OBJECTDIR}/funnel_model.o: funnel_model.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/funnel_model.o funnel_model.cpp
+
+${OBJECTDIR}/event_journal.o: event_journal.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/event_journal.o event_journal.cpp
+
+${OBJECTDIR}/url_template.o: url_template.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/url_template.o url_template.cpp
+
+${OBJECTDIR}/price_cipher.o: price_cipher.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/price_cipher.o price_cipher.cpp
+
 # Subprojects
 .build-subprojects:
 
+# Build Test Targets
+.build-tests-conf: .build-tests-subprojects .build-conf ${TESTFILES}
+.build-tests-subprojects:
+
+${TESTDIR}/TestFiles/f1: ${TESTDIR}/tests/event_journal_test.o ${OBJECTDIR}/event_journal.o ${OBJECTDIR}/event_scheduler.o ${OBJECTDIR}/arrival.o ${OBJECTDIR}/stats.o ${OBJECTDIR}/jsoncpp.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f1 $^ ${LDLIBSOPTIONS}
+
+${TESTDIR}/tests/event_journal_test.o: tests/event_journal_test.cpp 
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -I. -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/event_journal_test.o tests/event_journal_test.cpp
+
+${TESTDIR}/TestFiles/f2: ${TESTDIR}/tests/url_template_test.o ${OBJECTDIR}/url_template.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f2 $^ ${LDLIBSOPTIONS}
+
+${TESTDIR}/tests/url_template_test.o: tests/url_template_test.cpp 
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++11 -I. -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/url_template_test.o tests/url_template_test.cpp
+
+# Run Test Targets
+.test-conf:
+	@if [ "${TEST}" = "" ]; \
+	then  \
+	    ${TESTDIR}/TestFiles/f1 && \
+	    ${TESTDIR}/TestFiles/f2 && \
+	    true; \
+	else  \
+	    ./${TEST}; \
+	fi
+
 # Clean Targets
 .clean-conf: ${CLEAN_SUBPROJECTS}
 	${RM} -r ${CND_BUILDDIR}/${CND_CONF}
@@ -0,0 +1,349 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "notice_dispatcher.h"
+
+#include <iostream>
+#include <stdexcept>
+
+// the delayed notices are let go with a resolution of a millisecond
+const std::chrono::milliseconds delayTick{1};
+const size_t delaySlots{4096};
+
+using namespace std;
+
+NoticeDispatcher::NoticeDispatcher(const NoticeOptions &options)
+: options(options), nqueued{0}, ndelivered{0}, nfailed{0}, ndropped{0}, nbatches{0}, ndelayed{0}, stopping{false},
+held(delayTick, delaySlots), delayWakeAt{chrono::steady_clock::time_point::min()}
+{
+    delayer = thread(&NoticeDispatcher::delayLoop, this);
+    if (batching()) {
+        flusher = thread(&NoticeDispatcher::flushLoop, this);
+    }
+    if (options.health.count() > 0) {
+        checker = thread(&NoticeDispatcher::checkLoop, this);
+    }
+}
+
+NoticeDispatcher::~NoticeDispatcher() {
+    {
+        lock_guard<mutex> lck(batchMtx);
+        stopping = true;
+    }
+    batchCv.notify_all();
+    delayCv.notify_all();
+    if (delayer.joinable())
+        delayer.join();
+    if (flusher.joinable())
+        flusher.join();
+    if (checker.joinable())
+        checker.join();
+    drain();
+}
+
+NoticeDispatcher::Site *NoticeDispatcher::siteFor(const string &site, unsigned short port) {
+    const string key{isUnixSite(site) ? site : site + ":" + to_string(port)};
+    lock_guard<mutex> lck(mtx);
+    auto it = sites.find(key);
+    if (it != sites.end()) {
+        return it->second.get();
+    }
+
+    EngineOptions engine{};
+    engine.reactors = 1;
+    engine.connections = options.connections;
+    engine.outstanding = options.queue;
+    engine.pipeline = 1;
+    engine.onTimeout = TimeoutPolicy::Abort;
+    engine.linger = chrono::milliseconds{0};
+    engine.io = options.io;
+    engine.retry = RetryPolicy{0, chrono::milliseconds{0}, true};
+    unique_ptr<Site> &s = sites[key];
+    s.reset(new Site{});
+    s->key = key;
+    try {
+        const Endpoint endpoint{endpointFor(site, port)};
+        s->host = endpoint.unixPath.empty() ? endpoint.host : "localhost";
+        s->engine.reset(new HttpEngine(endpoint, engine));
+    } catch (const runtime_error &ex) {
+        // said once, the notices to it all fail
+        cerr << "Notices to " << key << " cannot be delivered: " << ex.what() << endl;
+    }
+    return s.get();
+}
+
+bool NoticeDispatcher::dispatch(const string &site, unsigned short port, string &&request, function<void()> onDelivered) {
+    ++nqueued;
+    return submit(site, port, std::move(request), 1, std::move(onDelivered));
+}
+
+void NoticeDispatcher::dispatchAfter(chrono::steady_clock::duration delay, const string &site, unsigned short port,
+        string &&request) {
+    if (delay <= chrono::steady_clock::duration::zero()) {
+        dispatch(site, port, std::move(request));
+        return;
+    }
+    ++nqueued;
+    ++ndelayed;
+    bool earlier{false};
+    {
+        lock_guard<mutex> lck(batchMtx);
+        const auto due = chrono::steady_clock::now() + delay;
+        earlier = due < delayWakeAt;
+        held.schedule(due, Delayed{site, port, std::move(request)});
+    }
+    // otherwise the delayer wakes up in time for it anyway
+    if (earlier)
+        delayCv.notify_one();
+}
+
+// hand a request carrying count notices to the endpoint's engine, dropping
+// it if the endpoint's queue is full or, with wait, waiting for room
+bool NoticeDispatcher::submit(const string &site, unsigned short port, string &&request, uint64_t count,
+        function<void()> onDelivered, bool wait) {
+    Site *s{siteFor(site, port)};
+    if (!s->engine) {
+        nfailed += count;
+        return true;
+    }
+
+    HttpExchange ex{std::move(request), chrono::steady_clock::now() + options.timeout,
+        [this, s, count, onDelivered](HttpResult & res) {
+            // no reply or a non-2xx one: the endpoint did not take the notice
+            if (res.status < 200 || res.status > 299) {
+                nfailed += count;
+                return;
+            }
+            ndelivered += count;
+            times.record(res.latency);
+            s->times.record(res.latency);
+            if (onDelivered)
+                onDelivered();
+        }};
+    if (wait) {
+        s->engine->submit(std::move(ex));
+    } else if (!s->engine->trySubmit(std::move(ex))) {
+        ndropped += count;
+        return false;
+    }
+    return true;
+}
+
+void NoticeDispatcher::post(const string &site, unsigned short port, const string &host, const string &path,
+        const string &json, function<void()> onDelivered) {
+    ++nqueued;
+    if (!batching()) {
+        submit(site, port, buildPost(host, path, json), 1, std::move(onDelivered));
+        return;
+    }
+
+    // one notice per line either way, a Json::FastWriter ends it with a newline already
+    const size_t length{!json.empty() && json.back() == '\n' ? json.length() - 1 : json.length()};
+    Batch full{};
+    {
+        lock_guard<mutex> lck(batchMtx);
+        Batch &b = open[site + " " + to_string(port) + " " + path];
+        if (b.count == 0) {
+            b.site = site;
+            b.port = port;
+            b.host = host;
+            b.path = path;
+            b.opened = chrono::steady_clock::now();
+            b.body = options.ndjson ? "" : "[";
+        } else if (!options.ndjson) {
+            b.body += ",\n";
+        }
+        b.body.append(json, 0, length);
+        if (options.ndjson)
+            b.body += '\n';
+        if (onDelivered)
+            b.onDelivered.push_back(std::move(onDelivered));
+        if (++b.count < options.batch)
+            return;
+        full = std::move(b);
+        b = Batch{};
+    }
+    send(std::move(full));
+}
+
+void NoticeDispatcher::send(Batch &&batch) {
+    if (!options.ndjson)
+        batch.body += "]";
+    ages.record(chrono::duration_cast<chrono::microseconds> (chrono::steady_clock::now() - batch.opened));
+    ++nbatches;
+
+    function<void()> delivered{};
+    if (!batch.onDelivered.empty()) {
+        auto callbacks = make_shared<vector<function<void()>>>(std::move(batch.onDelivered));
+        delivered = [callbacks] {
+            for (auto &f : *callbacks) {
+                f();
+            }
+        };
+    }
+    submit(batch.site, batch.port,
+            buildPost(batch.host, batch.path, batch.body, {}, options.ndjson ? "application/x-ndjson" : "application/json"),
+            batch.count, delivered);
+}
+
+// post the batches that have waited for the interval, and what is left at the end
+void NoticeDispatcher::flushLoop() {
+    unique_lock<mutex> lck(batchMtx);
+    for (;;) {
+        const auto now = chrono::steady_clock::now();
+        auto wakeAt = now + options.interval;
+        vector<Batch> due{};
+        for (auto &e : open) {
+            Batch &b = e.second;
+            if (b.count == 0)
+                continue;
+            if (stopping || b.opened + options.interval <= now) {
+                due.push_back(std::move(b));
+                b = Batch{};
+            } else if (b.opened + options.interval < wakeAt) {
+                wakeAt = b.opened + options.interval;
+            }
+        }
+        if (!due.empty()) {
+            lck.unlock();
+            for (auto &b : due) {
+                send(std::move(b));
+            }
+            lck.lock();
+            continue;
+        }
+        if (stopping)
+            return;
+        batchCv.wait_until(lck, wakeAt);
+    }
+}
+
+void NoticeDispatcher::drain() {
+    vector<Batch> left{};
+    vector<Delayed> early{};
+    {
+        lock_guard<mutex> lck(batchMtx);
+        for (auto &e : open) {
+            if (e.second.count > 0)
+                left.push_back(std::move(e.second));
+        }
+        open.clear();
+        held.clear([&early](Delayed & d) {
+            early.push_back(std::move(d));
+        });
+    }
+    for (auto &b : left) {
+        send(std::move(b));
+    }
+    // all at once, so they wait for room rather than overflow the queues
+    for (auto &d : early) {
+        submit(d.site, d.port, std::move(d.request), 1, nullptr, true);
+    }
+
+    // drained outside the lock so notices sent meanwhile, the health checks
+    // and endpoints() are not held up; sites are never removed
+    vector<HttpEngine *> engines{};
+    {
+        lock_guard<mutex> lck(mtx);
+        for (auto &s : sites) {
+            if (s.second->engine)
+                engines.push_back(s.second->engine.get());
+        }
+    }
+    for (HttpEngine *e : engines) {
+        e->drain();
+    }
+}
+
+// send the delayed notices as they fall due. What is left at the end is sent
+// by drain().
+void NoticeDispatcher::delayLoop() {
+    unique_lock<mutex> lck(batchMtx);
+    for (;;) {
+        vector<Delayed> due{};
+        held.advance(chrono::steady_clock::now(), [&due](Delayed & d) {
+            due.push_back(std::move(d));
+        });
+        if (!due.empty()) {
+            lck.unlock();
+            for (auto &d : due) {
+                submit(d.site, d.port, std::move(d.request), 1, nullptr);
+            }
+            lck.lock();
+            continue;
+        }
+        if (stopping)
+            return;
+        // until the earliest notice is due
+        delayWakeAt = held.empty() ? chrono::steady_clock::time_point::max() : held.nextDue();
+        if (held.empty()) {
+            delayCv.wait(lck);
+        } else {
+            delayCv.wait_until(lck, delayWakeAt);
+        }
+        delayWakeAt = chrono::steady_clock::time_point::min();
+    }
+}
+
+// get healthPath from every endpoint that can be reached, once per interval.
+// A check that fails takes its connection down (the engine aborts on a
+// timeout), and the engine connects it again.
+void NoticeDispatcher::checkLoop() {
+    unique_lock<mutex> lck(batchMtx);
+    for (;;) {
+        if (batchCv.wait_for(lck, options.health, [this] {
+                return stopping;
+            }))
+            return;
+        lck.unlock();
+
+        vector<Site *> all{};
+        {
+            lock_guard<mutex> sitesLck(mtx);
+            for (auto &s : sites) {
+                if (s.second->engine)
+                    all.push_back(s.second.get());
+            }
+        }
+        for (Site *s : all) {
+            HttpExchange ex{buildGet(s->host, options.healthPath), chrono::steady_clock::now() + options.timeout,
+                [s](HttpResult & res) {
+                    ++s->checks;
+                    if (res.status == 0) {
+                        ++s->failed;
+                        if (s->up.exchange(false)) {
+                            ++s->outages;
+                            cerr << "Notice endpoint " << s->key << " is down" << endl;
+                        }
+                    } else if (!s->up.exchange(true)) {
+                        cerr << "Notice endpoint " << s->key << " is up again" << endl;
+                    }
+                }};
+            // a full queue is checked next time
+            s->engine->trySubmit(std::move(ex));
+        }
+        lck.lock();
+    }
+}
+
+vector<EndpointStats> NoticeDispatcher::endpoints() {
+    vector<EndpointStats> all{};
+    lock_guard<mutex> lck(mtx);
+    for (auto &e : sites) {
+        const Site &s = *e.second;
+        all.push_back(EndpointStats{s.key, s.engine && s.up, s.checks, s.failed, s.outages,
+            s.engine ? s.engine->reconnects() : 0, &s.times});
+    }
+    return all;
+}
@@ -0,0 +1,205 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Delivery of the notices that follow an auction, such as win and loss
+// notices, off the auction's path. Each endpoint notices go to gets its own
+// HttpEngine, a pool of keep-alive connections, the first time one is sent
+// there. A notice that finds its endpoint's queue full is dropped and
+// counted rather than waited for. JSON notices may be batched: collected per
+// endpoint and path, up to a number of them or for a time, and posted
+// together as a JSON array or as newline delimited JSON. The connections are
+// kept open for the whole run and shared by every thread that sends; a
+// connection that fails is made again. Each endpoint may be checked on an
+// interval with a GET whose failures mark it as down until one succeeds.
+// Notices that are to go out after a delay, such as billing and loss notices,
+// are held on a timing wheel until they are due.
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+
+#include "http_engine.h"
+#include "stats.h"
+#include "timer_wheel.h"
+
+struct NoticeOptions {
+    int connections;                    // keep-alive connections per endpoint
+    size_t queue;                       // notices queued or in flight per endpoint before more are dropped
+    std::chrono::milliseconds timeout;  // give up on a notice's response after this
+    IoBackend io;
+    size_t batch;                       // JSON notices per request, 1 to post each on its own
+    std::chrono::milliseconds interval; // post a batch that is not full after this
+    bool ndjson;                        // a batch is newline delimited JSON rather than an array
+    std::chrono::milliseconds health;   // check each endpoint this often, 0 for never
+    std::string healthPath;             // by getting this
+};
+
+// how the notices to one endpoint, and its checks, went
+struct EndpointStats {
+    std::string endpoint;
+    bool up;            // the last check succeeded
+    uint64_t checks;
+    uint64_t failed;
+    uint64_t outages;   // times it went down
+    uint64_t reconnects;
+    const LatencyHistogram *deliveryTimes;
+};
+
+class NoticeDispatcher {
+public:
+    explicit NoticeDispatcher(const NoticeOptions &options);
+
+    // waits for the notices still queued
+    ~NoticeDispatcher();
+
+    NoticeDispatcher(const NoticeDispatcher &) = delete;
+    NoticeDispatcher &operator=(const NoticeDispatcher &) = delete;
+
+    // Queue a complete HTTP request to site and port, without blocking (any
+    // thread). onDelivered is called on a reactor thread once the response is
+    // in. Returns false if the notice was dropped.
+    bool dispatch(const std::string &site, unsigned short port, std::string &&request,
+            std::function<void()> onDelivered = nullptr);
+
+    // the same, delay from now (any thread)
+    void dispatchAfter(std::chrono::steady_clock::duration delay, const std::string &site, unsigned short port,
+            std::string &&request);
+
+    // Queue a JSON notice to be posted to path at site and port, on its own
+    // or in a batch with others to the same place
+    void post(const std::string &site, unsigned short port, const std::string &host, const std::string &path,
+            const std::string &json, std::function<void()> onDelivered = nullptr);
+
+    bool batching() const {
+        return options.batch > 1;
+    }
+
+    // send the batches as they are, and the delayed notices at once, and wait
+    // until every queued notice has been delivered or has failed
+    void drain();
+
+    uint64_t queued() const {
+        return nqueued.load();
+    }
+
+    uint64_t delivered() const {
+        return ndelivered.load();
+    }
+
+    // no response before the timeout, or the endpoint could not be reached
+    uint64_t failed() const {
+        return nfailed.load();
+    }
+
+    // the endpoint's queue was full
+    uint64_t dropped() const {
+        return ndropped.load();
+    }
+
+    // from a notice, or a batch of them, being written until its response was in
+    const LatencyHistogram &deliveryTimes() const {
+        return times;
+    }
+
+    // notices held back for a delay
+    uint64_t delayed() const {
+        return ndelayed.load();
+    }
+
+    // requests that carried a batch
+    uint64_t batches() const {
+        return nbatches.load();
+    }
+
+    // from a batch's first notice being queued until the batch was sent
+    const LatencyHistogram &batchAges() const {
+        return ages;
+    }
+
+    // of every endpoint notices have gone to
+    std::vector<EndpointStats> endpoints();
+
+private:
+    // notices collected for one endpoint and path
+    struct Batch {
+        std::string site;
+        unsigned short port{0};
+        std::string host;
+        std::string path;
+        std::string body;
+        size_t count{0};
+        std::chrono::steady_clock::time_point opened;
+        std::vector<std::function<void()>> onDelivered;
+    };
+
+    // a notice waiting for its delay
+    struct Delayed {
+        std::string site;
+        unsigned short port;
+        std::string request;
+    };
+
+    // an endpoint notices go to, with its connections
+    struct Site {
+        std::string key;
+        std::unique_ptr<HttpEngine> engine;     // null if it cannot be reached
+        std::string host;                       // for the checks
+        std::atomic<bool> up{true};
+        std::atomic<uint64_t> checks{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> outages{0};
+        LatencyHistogram times;
+    };
+
+    Site *siteFor(const std::string &site, unsigned short port);
+    bool submit(const std::string &site, unsigned short port, std::string &&request, uint64_t count,
+            std::function<void()> onDelivered, bool wait = false);
+    void send(Batch &&batch);
+    void flushLoop();
+    void checkLoop();
+    void delayLoop();
+
+    const NoticeOptions options;
+    std::mutex mtx;
+    std::map<std::string, std::unique_ptr<Site>> sites;    // by site and port
+    std::atomic<uint64_t> nqueued;
+    std::atomic<uint64_t> ndelivered;
+    std::atomic<uint64_t> nfailed;
+    std::atomic<uint64_t> ndropped;
+    std::atomic<uint64_t> nbatches;
+    std::atomic<uint64_t> ndelayed;
+    LatencyHistogram times;
+    LatencyHistogram ages;
+
+    std::mutex batchMtx;
+    std::condition_variable batchCv;
+    std::map<std::string, Batch> open;  // by site, port and path
+    bool stopping;
+    std::thread flusher;
+    std::thread checker;
+
+    TimerWheel<Delayed> held;   // under batchMtx
+    std::chrono::steady_clock::time_point delayWakeAt;  // when the delayer sleeps until, min while awake
+    std::condition_variable delayCv;
+    std::thread delayer;
+};
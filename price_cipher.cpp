@@ -0,0 +1,259 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "price_cipher.h"
+
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+inline uint32_t rotl(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+void putBigEndian(uint8_t *p, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        p[i] = static_cast<uint8_t> (v);
+        v >>= 8;
+    }
+}
+
+uint64_t getBigEndian(const uint8_t *p, int bytes) {
+    uint64_t v{0};
+    for (int i = 0; i < bytes; ++i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+const char webSafe[]{"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"};
+
+const size_t ivSize{16};
+const size_t priceSize{8};
+const size_t signatureSize{4};
+
+}
+
+Sha1::Sha1()
+: h{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0}, length{0}
+{
+}
+
+void Sha1::compress(const uint8_t *block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = static_cast<uint32_t> (getBigEndian(block + 4 * i, 4));
+    }
+    for (int i = 16; i < 80; ++i) {
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a{h[0]}, b{h[1]}, c{h[2]}, d{h[3]}, e{h[4]};
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        const uint32_t t{rotl(a, 5) + f + e + k + w[i]};
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+void Sha1::update(const uint8_t *data, size_t n) {
+    size_t used{static_cast<size_t> (length % blockSize)};
+    length += n;
+    if (used > 0) {
+        const size_t take{min(n, blockSize - used)};
+        memcpy(buffer + used, data, take);
+        data += take;
+        n -= take;
+        if (used + take < blockSize)
+            return;
+        compress(buffer);
+    }
+    for (; n >= blockSize; data += blockSize, n -= blockSize) {
+        compress(data);
+    }
+    memcpy(buffer, data, n);
+}
+
+void Sha1::finish(uint8_t digest[digestSize]) {
+    const uint64_t bits{length * 8};
+    uint8_t tail[2 * blockSize]{0x80};
+    const size_t used{static_cast<size_t> (length % blockSize)};
+    const size_t padding{(used < blockSize - 8 ? blockSize : 2 * blockSize) - used - 8};
+    putBigEndian(tail + padding, bits, 8);
+    update(tail, padding + 8);
+    for (int i = 0; i < 5; ++i) {
+        putBigEndian(digest + 4 * i, h[i], 4);
+    }
+}
+
+HmacSha1::HmacSha1(const string &key) {
+    uint8_t block[Sha1::blockSize]{};
+    if (key.length() > Sha1::blockSize) {
+        Sha1 hashed{};
+        hashed.update(reinterpret_cast<const uint8_t *> (key.data()), key.length());
+        hashed.finish(block);
+    } else {
+        memcpy(block, key.data(), key.length());
+    }
+    uint8_t pad[Sha1::blockSize];
+    for (size_t i = 0; i < Sha1::blockSize; ++i) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    inner.update(pad, sizeof (pad));
+    for (size_t i = 0; i < Sha1::blockSize; ++i) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    outer.update(pad, sizeof (pad));
+}
+
+void HmacSha1::sign(const uint8_t *data, size_t length, uint8_t mac[Sha1::digestSize]) const {
+    uint8_t digest[Sha1::digestSize];
+    Sha1 in{inner};
+    in.update(data, length);
+    in.finish(digest);
+    Sha1 out{outer};
+    out.update(digest, sizeof (digest));
+    out.finish(mac);
+}
+
+PriceCipher::PriceCipher(const string &encryptionKey, const string &integrityKey)
+: encryption{encryptionKey}, integrity{integrityKey},
+serial{static_cast<uint64_t> (chrono::steady_clock::now().time_since_epoch().count())}
+{
+}
+
+string PriceCipher::encrypt(double price) {
+    // seconds and microseconds, then a serial number, as the exchanges do
+    const auto now = chrono::duration_cast<chrono::microseconds> (chrono::system_clock::now().time_since_epoch()).count();
+    uint8_t iv[ivSize];
+    putBigEndian(iv, static_cast<uint64_t> (now / 1000000), 4);
+    putBigEndian(iv + 4, static_cast<uint64_t> (now % 1000000), 4);
+    putBigEndian(iv + 8, serial++, 8);
+    return encrypt(static_cast<uint64_t> (price * 1e6 + 0.5), iv);
+}
+
+string PriceCipher::encrypt(uint64_t micros, const uint8_t iv[ivSize]) const {
+    uint8_t out[ivSize + priceSize + signatureSize];
+    uint8_t mac[Sha1::digestSize];
+    memcpy(out, iv, ivSize);
+
+    // the signature is of the price and vector
+    uint8_t signed_[priceSize + ivSize];
+    putBigEndian(signed_, micros, priceSize);
+    memcpy(signed_ + priceSize, iv, ivSize);
+    integrity.sign(signed_, sizeof (signed_), mac);
+    memcpy(out + ivSize + priceSize, mac, signatureSize);
+
+    encryption.sign(iv, ivSize, mac);
+    for (size_t i = 0; i < priceSize; ++i) {
+        out[ivSize + i] = signed_[i] ^ mac[i];
+    }
+    return encodeWebSafeBase64(out, sizeof (out));
+}
+
+bool PriceCipher::decrypt(const string &encrypted, uint64_t &micros) const {
+    const string raw{decodeWebSafeBase64(encrypted)};
+    if (raw.length() != ivSize + priceSize + signatureSize)
+        return false;
+    const uint8_t *in{reinterpret_cast<const uint8_t *> (raw.data())};
+
+    uint8_t mac[Sha1::digestSize];
+    encryption.sign(in, ivSize, mac);
+    uint8_t signed_[priceSize + ivSize];
+    for (size_t i = 0; i < priceSize; ++i) {
+        signed_[i] = in[ivSize + i] ^ mac[i];
+    }
+    memcpy(signed_ + priceSize, in, ivSize);
+    integrity.sign(signed_, sizeof (signed_), mac);
+    if (memcmp(mac, in + ivSize + priceSize, signatureSize) != 0)
+        return false;
+    micros = getBigEndian(signed_, priceSize);
+    return true;
+}
+
+string encodeWebSafeBase64(const uint8_t *data, size_t length) {
+    string s{};
+    s.reserve((length * 4 + 2) / 3);
+    size_t i{0};
+    for (; i + 3 <= length; i += 3) {
+        const uint32_t v{static_cast<uint32_t> (data[i]) << 16 | data[i + 1] << 8 | data[i + 2]};
+        s += webSafe[v >> 18];
+        s += webSafe[(v >> 12) & 63];
+        s += webSafe[(v >> 6) & 63];
+        s += webSafe[v & 63];
+    }
+    if (i < length) {
+        const uint32_t v{static_cast<uint32_t> (data[i]) << 16 | (i + 1 < length ? data[i + 1] << 8 : 0)};
+        s += webSafe[v >> 18];
+        s += webSafe[(v >> 12) & 63];
+        if (i + 1 < length)
+            s += webSafe[(v >> 6) & 63];
+    }
+    return s;
+}
+
+string decodeWebSafeBase64(const string &s) {
+    string out{};
+    uint32_t v{0};
+    int bits{0};
+    for (char ch : s) {
+        int d;
+        if (ch >= 'A' && ch <= 'Z') {
+            d = ch - 'A';
+        } else if (ch >= 'a' && ch <= 'z') {
+            d = ch - 'a' + 26;
+        } else if (ch >= '0' && ch <= '9') {
+            d = ch - '0' + 52;
+        } else if (ch == '-' || ch == '+') {
+            d = 62;
+        } else if (ch == '_' || ch == '/') {
+            d = 63;
+        } else if (ch == '=') {
+            break;
+        } else {
+            return string();
+        }
+        v = v << 6 | static_cast<uint32_t> (d);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char> ((v >> bits) & 0xff);
+        }
+    }
+    return out;
+}
@@ -0,0 +1,88 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Encryption of the clearing price in ${AUCTION_PRICE}, the way exchanges
+// such as DoubleClick do it, so that a bidder's decrypting of its win notices
+// is under load too. The price in micros is XORed with a pad, the HMAC-SHA1
+// of a 16 byte initialization vector under the encryption key, and signed
+// with the first 4 bytes of the HMAC-SHA1 of price and vector under the
+// integrity key. The vector, encrypted price and signature go into the URL as
+// 38 characters of web safe base64.
+// Each key is absorbed into the HMAC's inner and outer SHA-1 states once, and
+// those states are copied for every price, so a price costs four SHA-1 blocks.
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+class Sha1 {
+public:
+    static const size_t digestSize{20};
+    static const size_t blockSize{64};
+
+    Sha1();
+
+    void update(const uint8_t *data, size_t length);
+
+    // the digest of what was added, after which the state is spent
+    void finish(uint8_t digest[digestSize]);
+
+private:
+    void compress(const uint8_t *block);
+
+    uint32_t h[5];
+    uint8_t buffer[blockSize];
+    uint64_t length;    // in bytes
+};
+
+// HMAC-SHA1 with the key already absorbed
+class HmacSha1 {
+public:
+    explicit HmacSha1(const std::string &key);
+
+    void sign(const uint8_t *data, size_t length, uint8_t mac[Sha1::digestSize]) const;
+
+private:
+    Sha1 inner;
+    Sha1 outer;
+};
+
+class PriceCipher {
+public:
+    // raw keys, as decoded from the exchange's web safe base64
+    PriceCipher(const std::string &encryptionKey, const std::string &integrityKey);
+
+    // the price in the currency's units, with a new initialization vector (any thread)
+    std::string encrypt(double price);
+
+    // the same with the given vector
+    std::string encrypt(uint64_t micros, const uint8_t iv[16]) const;
+
+    // what a bidder does with it. Returns false if it does not decode or the
+    // signature does not match.
+    bool decrypt(const std::string &encrypted, uint64_t &micros) const;
+
+private:
+    const HmacSha1 encryption;
+    const HmacSha1 integrity;
+    std::atomic<uint64_t> serial;   // second half of the vectors
+};
+
+std::string encodeWebSafeBase64(const uint8_t *data, size_t length);
+
+// with or without padding; empty if s is not base64
+std::string decodeWebSafeBase64(const std::string &s);
@@ -0,0 +1,160 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Internals of the HttpEngine. A reactor thread owns a share of the engine's
+// connections and does the request bookkeeping (backlog, pipelining, response
+// matching and deadlines); subclasses do the socket I/O, with epoll or with
+// io_uring.
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http_engine.h"
+#include "timer_wheel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+enum class ConnState {
+    Closed, Connecting, Open
+};
+
+// A request with what the reactor keeps track of across retries
+struct Request {
+    HttpExchange ex;
+    unsigned attempt;           // 0 for the first send
+    Clock::duration budget;     // from being posted to the original deadline
+    Clock::time_point cutoff;   // a fresh deadline is never later than this
+};
+
+struct Pending {
+    Request req;
+    uint64_t seq;
+    bool abandoned;             // timed out and reported, the response is discarded when it comes
+    uint64_t endByte;           // position of the request's last byte in the connection's output
+    Clock::time_point written;  // when that byte was handed to the kernel
+};
+
+struct Connection {
+    int fd{-1};
+    ConnState state{ConnState::Closed};
+    bool wantWrite{false};      // EPOLLOUT is part of the registered interest
+    bool ready{false};          // connection is on the reactor's ready list
+    std::deque<iovec> out;      // request bytes not yet written, in the requests in flight
+    uint64_t queuedBytes{0};    // bytes ever queued on this connection
+    uint64_t sentBytes{0};      // bytes ever written on this connection
+    std::string in;             // response bytes not yet consumed
+    std::deque<Pending> inflight;   // requests sent, responses come back in this order
+    Clock::time_point retryAt{};
+};
+
+// A deadline on the timer wheel: request seq, either in the backlog
+// (noConnection) or in flight on connection conn
+struct Expiry {
+    size_t conn;
+    uint64_t seq;
+};
+
+const size_t noConnection{~size_t{0}};
+
+class Reactor {
+public:
+    Reactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections, const EngineOptions &options);
+    virtual ~Reactor();
+
+    // hand a request over to this reactor (any thread)
+    void post(HttpExchange &&ex);
+
+    // CPU time used by the reactor thread so far
+    std::chrono::microseconds cpuTime() const;
+
+protected:
+    // The thread calls the I/O functions below, so a subclass starts it at
+    // the end of its constructor and stops it at the start of its destructor.
+    void start();
+    void stop();
+
+    // start connecting c's socket
+    virtual void connect(Connection &c) = 0;
+    // let go of c's socket, it is being closed
+    virtual void release(Connection &c) = 0;
+    // write the pieces c has queued in c.out, now or as soon as the socket takes it
+    virtual void flush(Connection &c) = 0;
+    // wait for I/O for up to timeout and handle it
+    virtual void poll(std::chrono::milliseconds timeout) = 0;
+    // make poll() return early (any thread)
+    virtual void wake() = 0;
+
+    // whether a closed connection can be connected again yet
+    virtual bool reusable(const Connection &) const {
+        return true;
+    }
+
+    // for the I/O functions to report progress
+    void opened(size_t idx);
+    void written(Connection &c, size_t n);
+    void received(size_t idx, bool eof);
+    void close(Connection &c);
+
+    size_t indexOf(const Connection &c) const {
+        return static_cast<size_t> (&c - &conns[0]);
+    }
+
+    const sockaddr_storage addr;
+    const socklen_t addrlen;
+    std::vector<Connection> conns;
+
+private:
+    void run();
+    void makeReady(size_t idx);
+    void dispatch();
+    void expire(const Expiry &e);
+    void abort(Connection &c, uint64_t cause);
+    void complete(HttpExchange &ex, HttpResult &res);
+    void fail(HttpExchange &ex, bool timedOut);
+    void retry(Request &&req);
+
+    HttpEngine &engine;
+    const size_t depth;             // requests allowed in flight per connection
+    const TimeoutPolicy onTimeout;
+    const std::chrono::milliseconds linger;
+    const RetryPolicy retryPolicy;
+
+    std::atomic<bool> running;
+
+    std::mutex mtx;
+    std::deque<HttpExchange> incoming;  // posted, not yet seen by the reactor thread
+
+    // the members below are only touched by the reactor thread
+    std::map<uint64_t, Request> backlog;        // waiting for a free connection, by seq
+    std::multimap<Clock::time_point, Request> retries;  // backing off until they go to the backlog
+    std::deque<size_t> readyList;   // connections that can take another request
+    TimerWheel<Expiry> deadlines;
+    uint64_t seq;
+
+    std::thread worker;
+};
+
+// Whether this kernel lets us use the io_uring reactor
+bool uringAvailable();
+
+Reactor *newEpollReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections,
+        const EngineOptions &options);
+Reactor *newUringReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections,
+        const EngineOptions &options);
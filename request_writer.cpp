@@ -0,0 +1,94 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "request_writer.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+namespace {
+
+// "<length>\r\n\r\n" into buf, returns its length
+size_t lengthField(char *buf, size_t size, size_t length) {
+    return static_cast<size_t> (snprintf(buf, size, "%zu\r\n\r\n", length));
+}
+
+} // namespace
+
+RequestWriter::RequestWriter(const string &host, const string &path, const vector<pair<string, string>> &headers,
+        const string &contentType) {
+    block = "POST " + path + " HTTP/1.1\r\n";
+    block += "Host: " + host + "\r\n";
+    block += "Connection: Keep-Alive\r\n";
+    block += "Content-Type: " + contentType + "\r\n";
+    for (auto &h : headers) {
+        block += h.first + ": " + h.second + "\r\n";
+    }
+    block += "Content-Length: ";
+}
+
+bool RequestWriter::send(int fd, const string &body) const {
+    char length[32];
+    iovec iov[3]{
+        {const_cast<char *> (block.data()), block.length()},
+        {length, lengthField(length, sizeof (length), body.length())},
+        {const_cast<char *> (body.data()), body.length()}};
+
+    // a short write only happens when the socket buffer is full; carry on
+    // from where it stopped
+    int first{0};
+    while (first < 3) {
+        msghdr msg{};
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = static_cast<size_t> (3 - first);
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        size_t done{static_cast<size_t> (n)};
+        while (first < 3 && done >= iov[first].iov_len) {
+            done -= iov[first].iov_len;
+            ++first;
+        }
+        if (first < 3) {
+            iov[first].iov_base = static_cast<char *> (iov[first].iov_base) + done;
+            iov[first].iov_len -= done;
+        }
+    }
+    return true;
+}
+
+string RequestWriter::head(size_t length) const {
+    char field[32];
+    const size_t n{lengthField(field, sizeof (field), length)};
+    string request{};
+    request.reserve(block.length() + n);
+    request.append(block).append(field, n);
+    return request;
+}
+
+string RequestWriter::render(const string &body) const {
+    char length[32];
+    const size_t n{lengthField(length, sizeof (length), body.length())};
+    string request{};
+    request.reserve(block.length() + n + body.length());
+    request.append(block).append(length, n).append(body);
+    return request;
+}
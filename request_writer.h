@@ -0,0 +1,44 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+// Writes keep-alive POST requests, JSON unless told otherwise, to one host and path. The header
+// block is rendered once, with Content-Length last, so that per request
+// only the length digits are filled in.
+class RequestWriter {
+public:
+    RequestWriter(const std::string &host, const std::string &path,
+            const std::vector<std::pair<std::string, std::string>> &headers = {},
+            const std::string &contentType = "application/json");
+
+    // Send the request with one sendmsg() on the blocking socket fd: the
+    // header block, the length and the body straight from where it is.
+    // Returns false with errno set if the socket failed.
+    bool send(int fd, const std::string &body) const;
+
+    // the whole request in one string, e.g. to queue on a connection
+    std::string render(const std::string &body) const;
+
+    // the header block with the length filled in, for a body of that
+    // length to be written after it from wherever it is
+    std::string head(size_t length) const;
+
+private:
+    std::string block;
+};
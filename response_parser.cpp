@@ -0,0 +1,280 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "response_parser.h"
+
+#include <cstring>
+#include <strings.h>
+#include <zlib.h>
+
+using namespace std;
+
+namespace {
+
+const size_t maxHead{65536};
+
+enum class Encoding {
+    Identity, Gzip, Deflate, Unknown
+};
+
+bool is(const char *value, size_t len, const char *token) {
+    return len == strlen(token) && strncasecmp(value, token, len) == 0;
+}
+
+// skip optional white space at both ends of [value, value + len)
+void trim(const char *&value, size_t &len) {
+    while (len > 0 && (*value == ' ' || *value == '\t')) {
+        ++value;
+        --len;
+    }
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        --len;
+}
+
+// read a decimal or (for chunk sizes) hexadecimal number, false if there is none or it overflows
+bool number(const char *p, const char *end, int base, size_t &n, const char *&stop) {
+    n = 0;
+    const char *start{p};
+    for (; p < end; ++p) {
+        int digit;
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else if (base == 16 && *p >= 'A' && *p <= 'F')
+            digit = *p - 'A' + 10;
+        else
+            break;
+        if (n > (~size_t{0} - digit) / base)
+            return false;
+        n = n * base + digit;
+    }
+    stop = p;
+    return p > start;
+}
+
+// Walk a chunked body starting at p. Returns Complete with the end of the
+// body (after the trailers) in end, or Incomplete or BadChunk.
+ParseResult scanChunks(const char *p, const char *limit, const char *&end, size_t &bodyLength) {
+    bodyLength = 0;
+    for (;;) {
+        const char *eol{static_cast<const char *> (memmem(p, limit - p, "\r\n", 2))};
+        if (eol == nullptr)
+            return limit - p > 1024 ? ParseResult::BadChunk : ParseResult::Incomplete;
+        size_t size;
+        const char *stop;
+        if (!number(p, eol, 16, size, stop) || (stop != eol && *stop != ';' && *stop != ' ' && *stop != '\t'))
+            return ParseResult::BadChunk;
+        p = eol + 2;
+        if (size == 0)
+            break;
+        if (static_cast<size_t> (limit - p) < size + 2)
+            return ParseResult::Incomplete;
+        if (p[size] != '\r' || p[size + 1] != '\n')
+            return ParseResult::BadChunk;
+        bodyLength += size;
+        p += size + 2;
+    }
+    // trailer lines, up to an empty one
+    for (;;) {
+        const char *eol{static_cast<const char *> (memmem(p, limit - p, "\r\n", 2))};
+        if (eol == nullptr)
+            return ParseResult::Incomplete;
+        const bool empty{eol == p};
+        p = eol + 2;
+        if (empty)
+            break;
+    }
+    end = p;
+    return ParseResult::Complete;
+}
+
+// Move the data of the chunks scanChunks() has checked together, just after
+// the head. It can only move backwards, so this is done in place.
+void joinChunks(char *p, const char *limit) {
+    char *out{p};
+    for (;;) {
+        char *eol{static_cast<char *> (memmem(p, limit - p, "\r\n", 2))};
+        size_t size;
+        const char *stop;
+        number(p, eol, 16, size, stop);
+        p = eol + 2;
+        if (size == 0)
+            return;
+        memmove(out, p, size);
+        out += size;
+        p += size + 2;
+    }
+}
+
+bool inflateBody(const char *body, size_t len, Encoding encoding, string &out) {
+    z_stream zs{};
+    // 16 + MAX_WBITS: gzip wrapper. Deflate is taken with the zlib wrapper
+    // that HTTP specifies, or without it as some servers send it.
+    int windowBits{encoding == Encoding::Gzip ? 16 + MAX_WBITS : MAX_WBITS};
+    if (encoding == Encoding::Deflate && len > 0 && (static_cast<unsigned char> (body[0]) & 0x0f) != Z_DEFLATED)
+        windowBits = -MAX_WBITS;
+    if (inflateInit2(&zs, windowBits) != Z_OK)
+        return false;
+    zs.next_in = reinterpret_cast<Bytef *> (const_cast<char *> (body));
+    zs.avail_in = static_cast<uInt> (len);
+
+    out.clear();
+    char chunk[16384];
+    int r;
+    do {
+        zs.next_out = reinterpret_cast<Bytef *> (chunk);
+        zs.avail_out = sizeof (chunk);
+        r = inflate(&zs, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return false;
+        }
+        out.append(chunk, sizeof (chunk) - zs.avail_out);
+    } while (r != Z_STREAM_END && (zs.avail_in > 0 || zs.avail_out == 0));
+    inflateEnd(&zs);
+    return r == Z_STREAM_END;
+}
+
+// parse the single response at the start of buf
+ParseResult parseOne(char *buf, size_t len, ParsedResponse &res) {
+    // "HTTP/1.x NNN" and at least the line end
+    if (len < 14)
+        return ParseResult::Incomplete;
+    if (memcmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ')
+        return ParseResult::BadStatusLine;
+    const char *headEnd{static_cast<const char *> (memmem(buf, len, "\r\n\r\n", 4))};
+    if (headEnd == nullptr)
+        return len > maxHead ? ParseResult::BadHeader : ParseResult::Incomplete;
+
+    size_t status;
+    const char *stop;
+    if (!number(buf + 9, buf + 12, 10, status, stop) || stop != buf + 12 || (buf[12] != ' ' && buf[12] != '\r'))
+        return ParseResult::BadStatusLine;
+    res.status = static_cast<int> (status);
+    res.close = buf[7] == '0'; // HTTP/1.0 closes unless asked to keep alive
+    res.decoded.clear();
+    char *const bodyStart{buf + (headEnd + 4 - buf)};
+
+    // no body, whatever the headers say: only Connection matters
+    const bool bodyless{status == 204 || status == 304 || status < 200};
+
+    bool haveLength{false};
+    bool chunked{false};
+    size_t length{0};
+    Encoding encoding{Encoding::Identity};
+
+    const char *line{static_cast<const char *> (memchr(buf, '\n', headEnd + 2 - buf)) + 1};
+    while (line < headEnd + 2) {
+        const char *eol{static_cast<const char *> (memmem(line, headEnd + 2 - line, "\r\n", 2))};
+        const char *colon{static_cast<const char *> (memchr(line, ':', eol - line))};
+        if (colon == nullptr)
+            return ParseResult::BadHeader;
+        const size_t nameLength{static_cast<size_t> (colon - line)};
+        const char *value{colon + 1};
+        size_t valueLength{static_cast<size_t> (eol - value)};
+        trim(value, valueLength);
+
+        if (is(line, nameLength, "Connection")) {
+            if (is(value, valueLength, "close"))
+                res.close = true;
+            else if (is(value, valueLength, "keep-alive"))
+                res.close = false;
+        } else if (bodyless) {
+            // the rest does not apply
+        } else if (is(line, nameLength, "Content-Length")) {
+            if (!number(value, value + valueLength, 10, length, stop) || stop != value + valueLength)
+                return ParseResult::BadLength;
+            haveLength = true;
+        } else if (is(line, nameLength, "Transfer-Encoding")) {
+            chunked = valueLength >= 7 && strncasecmp(value + valueLength - 7, "chunked", 7) == 0;
+        } else if (is(line, nameLength, "Content-Encoding")) {
+            if (is(value, valueLength, "gzip") || is(value, valueLength, "x-gzip"))
+                encoding = Encoding::Gzip;
+            else if (is(value, valueLength, "deflate"))
+                encoding = Encoding::Deflate;
+            else if (!is(value, valueLength, "identity"))
+                encoding = Encoding::Unknown;
+        }
+        line = eol + 2;
+    }
+
+    if (bodyless) {
+        res.length = bodyStart - buf;
+        res.body = bodyStart;
+        res.bodyLength = 0;
+        return ParseResult::Complete;
+    }
+
+    const char *limit{buf + len};
+    if (chunked) {
+        // chunked wins over a Content-Length
+        const char *end;
+        ParseResult r{scanChunks(bodyStart, limit, end, res.bodyLength)};
+        if (r != ParseResult::Complete)
+            return r;
+        joinChunks(bodyStart, end);
+        res.length = end - buf;
+    } else if (haveLength) {
+        if (static_cast<size_t> (limit - bodyStart) < length)
+            return ParseResult::Incomplete;
+        res.length = bodyStart - buf + length;
+        res.bodyLength = length;
+    } else {
+        return ParseResult::NoLength; // a body up to the end of the connection is not supported
+    }
+    res.body = bodyStart;
+
+    if (encoding == Encoding::Unknown)
+        return ParseResult::BadEncoding;
+    if (encoding != Encoding::Identity && res.bodyLength > 0) {
+        if (!inflateBody(res.body, res.bodyLength, encoding, res.decoded))
+            return ParseResult::BadEncoding;
+        res.body = res.decoded.data();
+        res.bodyLength = res.decoded.length();
+    }
+    return ParseResult::Complete;
+}
+
+} // namespace
+
+const char *describe(ParseResult result) {
+    switch (result) {
+        case ParseResult::Complete: return "complete";
+        case ParseResult::Incomplete: return "incomplete";
+        case ParseResult::BadStatusLine: return "bad status line";
+        case ParseResult::BadHeader: return "bad header";
+        case ParseResult::BadLength: return "bad Content-Length";
+        case ParseResult::BadChunk: return "bad chunk";
+        case ParseResult::NoLength: return "no Content-Length";
+        case ParseResult::BadEncoding: return "bad Content-Encoding";
+    }
+    return "unknown";
+}
+
+// Interim 1xx responses (100 Continue, 103 Early Hints) come before the
+// final one and are taken off with it. 101 ends the exchange, so it is final.
+ParseResult parseResponse(char *buf, size_t len, ParsedResponse &res) {
+    size_t skipped{0};
+    for (;;) {
+        ParseResult r{parseOne(buf + skipped, len - skipped, res)};
+        if (r != ParseResult::Complete)
+            return r;
+        if (res.status < 100 || res.status > 199 || res.status == 101) {
+            res.length += skipped;
+            return r;
+        }
+        skipped += res.length;
+    }
+}
@@ -0,0 +1,52 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// HTTP/1.1 response parser working directly on a connection's receive
+// buffer. Malformed responses are reported with a code, not an exception.
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+enum class ParseResult {
+    Complete,           // a whole response is at the start of the buffer
+    Incomplete,         // more bytes are needed
+    BadStatusLine,
+    BadHeader,          // a header line without a colon, or a head that is too large
+    BadLength,          // Content-Length is not a number
+    BadChunk,           // a chunk size line is malformed
+    NoLength,           // a body that is neither length delimited nor chunked
+    BadEncoding         // the Content-Encoding is not supported, or the body does not decode
+};
+
+// a short description of a result, for log and error messages
+const char *describe(ParseResult result);
+
+struct ParsedResponse {
+    int status;
+    bool close;             // the server closes the connection after this response
+    size_t length;          // bytes of the buffer the response takes up
+    const char *body;       // the body, dechunked and decoded
+    size_t bodyLength;
+    std::string decoded;    // holds the body if it had to be inflated, body points into it then
+};
+
+// Parse the response at the start of buf. With a Complete result buf may
+// have been changed up to res.length: a chunked body is joined up in place,
+// and res.body points into buf unless the body was gzip or deflate encoded.
+// Interim 1xx responses before the final one are skipped: res describes
+// the final response and res.length covers them too. Responses to HEAD
+// requests are not supported.
+ParseResult parseResponse(char *buf, size_t len, ParsedResponse &res);
@@ -0,0 +1,138 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "stats.h"
+
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram() : total{0}, sum{0} {
+    for (auto &c : counts) {
+        c.store(0, memory_order_relaxed);
+    }
+}
+
+// values below 32 get a bucket each, above that 16 buckets per power of two
+int LatencyHistogram::index(uint64_t us) {
+    if (us < 32)
+        return static_cast<int> (us);
+    int msb{63 - __builtin_clzll(us)};
+    int shift{msb - 4};
+    int idx{(shift + 1) * 16 + static_cast<int> ((us >> shift) - 16)};
+    return idx < nbuckets ? idx : nbuckets - 1;
+}
+
+uint64_t LatencyHistogram::upperBound(int idx) {
+    if (idx < 32)
+        return static_cast<uint64_t> (idx);
+    int shift{idx / 16 - 1};
+    return ((static_cast<uint64_t> (idx % 16) + 17) << shift) - 1;
+}
+
+void LatencyHistogram::record(chrono::microseconds latency) {
+    uint64_t us{latency.count() > 0 ? static_cast<uint64_t> (latency.count()) : 0};
+    counts[index(us)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(us, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+    return total.load(memory_order_relaxed);
+}
+
+chrono::microseconds LatencyHistogram::percentile(double p) const {
+    uint64_t n{count()};
+    if (n == 0)
+        return chrono::microseconds{0};
+    uint64_t rank{static_cast<uint64_t> (p * n)};
+    if (rank >= n)
+        rank = n - 1;
+    uint64_t seen{0};
+    for (int i = 0; i < nbuckets; ++i) {
+        seen += bucket(i);
+        if (seen > rank)
+            return chrono::microseconds{upperBound(i)};
+    }
+    return chrono::microseconds{upperBound(nbuckets - 1)};
+}
+
+chrono::microseconds LatencyHistogram::max() const {
+    for (int i = nbuckets - 1; i >= 0; --i) {
+        if (bucket(i) != 0)
+            return chrono::microseconds{upperBound(i)};
+    }
+    return chrono::microseconds{0};
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (int i = 0; i < nbuckets; ++i) {
+        add(i, other.bucket(i));
+    }
+    total.fetch_add(other.total.load(memory_order_relaxed), memory_order_relaxed);
+    sum.fetch_add(other.sum.load(memory_order_relaxed), memory_order_relaxed);
+}
+
+Json::Value LatencyHistogram::toJson() const {
+    Json::Value json{};
+    json["sum"] = static_cast<Json::UInt64> (sum.load(memory_order_relaxed));
+    json["buckets"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < nbuckets; ++i) {
+        uint64_t n{bucket(i)};
+        if (n == 0)
+            continue;
+        Json::Value b{Json::arrayValue};
+        b.append(i);
+        b.append(static_cast<Json::UInt64> (n));
+        json["buckets"].append(b);
+    }
+    return json;
+}
+
+void LatencyHistogram::merge(const Json::Value &json) {
+    for (auto &b : json["buckets"]) {
+        int idx{b[0].asInt()};
+        uint64_t n{b[1].asUInt64()};
+        if (idx < 0 || idx >= nbuckets)
+            continue;
+        add(idx, n);
+        total.fetch_add(n, memory_order_relaxed);
+    }
+    sum.fetch_add(json["sum"].asUInt64(), memory_order_relaxed);
+}
+
+string LatencyHistogram::summary() const {
+    uint64_t n{count()};
+    ostringstream os{};
+    os << fixed << setprecision(2);
+    os << "n=" << n;
+    os << " mean=" << (n ? sum.load(memory_order_relaxed) / 1000.0 / n : 0.0);
+    os << " p50=" << percentile(0.50).count() / 1000.0;
+    os << " p90=" << percentile(0.90).count() / 1000.0;
+    os << " p99=" << percentile(0.99).count() / 1000.0;
+    os << " p99.9=" << percentile(0.999).count() / 1000.0;
+    os << " max=" << max().count() / 1000.0 << " ms";
+    return os.str();
+}
+
+void KeyedCounters::add(const string &key, uint64_t n) {
+    lock_guard<mutex> lck(mtx);
+    counts[key] += n;
+}
+
+map<string, uint64_t> KeyedCounters::snapshot() const {
+    lock_guard<mutex> lck(mtx);
+    return counts;
+}
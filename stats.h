@@ -0,0 +1,82 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+#include "json/json.h"
+
+// Latency histogram with 16 linear sub-buckets per power of two (about 6%
+// resolution) from 1 us to days. Any number of threads may record into it.
+class LatencyHistogram {
+public:
+    static const int nbuckets = 640;
+
+    LatencyHistogram();
+
+    void record(std::chrono::microseconds latency);
+
+    uint64_t count() const;
+
+    // latency below which the fraction p (0..1) of the recorded values fall
+    std::chrono::microseconds percentile(double p) const;
+
+    std::chrono::microseconds max() const;
+
+    // add the counts of another histogram to this one
+    void merge(const LatencyHistogram &other);
+
+    // count, mean and the usual percentiles on one line, in ms
+    std::string summary() const;
+
+    // the non-empty buckets as [[index, count], ...] plus the sum, for
+    // shipping a histogram to another process and merging it there
+    Json::Value toJson() const;
+    void merge(const Json::Value &json);
+
+    uint64_t bucket(int idx) const {
+        return counts[idx].load(std::memory_order_relaxed);
+    }
+
+    void add(int idx, uint64_t n) {
+        counts[idx].fetch_add(n, std::memory_order_relaxed);
+    }
+
+private:
+    static int index(uint64_t us);
+    static uint64_t upperBound(int idx);
+
+    std::atomic<uint64_t> counts[nbuckets];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+};
+
+// Named counters for events that are rare enough to take a lock, such as
+// timeouts per bidder and slot size
+class KeyedCounters {
+public:
+    void add(const std::string &key, uint64_t n = 1);
+
+    std::map<std::string, uint64_t> snapshot() const;
+
+private:
+    mutable std::mutex mtx;
+    std::map<std::string, uint64_t> counts;
+};
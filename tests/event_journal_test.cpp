@@ -0,0 +1,241 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of the event journal and of the scheduler's memory budget, in the
+// format of the NetBeans simple tests.
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <unistd.h>
+
+#include "event_journal.h"
+#include "event_scheduler.h"
+
+using namespace std;
+
+namespace {
+
+int failures{0};
+
+void fail(const char *test, const string &message) {
+    cout << "%TEST_FAILED% time=0 testname=" << test << " (event_journal_test) message=" << message << endl;
+    ++failures;
+}
+
+string journalPath(const char *test) {
+    const string path{"/tmp/event_journal_test." + to_string(getpid()) + "." + test};
+    ::unlink(path.c_str());
+    return path;
+}
+
+unique_ptr<EventJournal> journalOf(const string &path, size_t records) {
+    return unique_ptr<EventJournal>{new EventJournal(path, records * 256)};
+}
+
+// wait up to a few seconds for the scheduler to send what is due
+void settle(const EventScheduler &scheduler, uint64_t pending) {
+    const auto until = chrono::steady_clock::now() + chrono::seconds{10};
+    while (scheduler.pending() > pending && chrono::steady_clock::now() < until) {
+        this_thread::sleep_for(chrono::milliseconds{5});
+    }
+}
+
+// records are free again as soon as their event is sent, in any order
+void testOutOfOrder() {
+    const string path{journalPath("order")};
+    {
+        unique_ptr<EventJournal> journal{journalOf(path, 4)};
+        uint64_t pos[4];
+        for (int i = 0; i < 4; ++i) {
+            pos[i] = journal->append(chrono::system_clock::now(), "bid" + to_string(i), "1", "CLICK", 0);
+        }
+        if (journal->append(chrono::system_clock::now(), "bid4", "1", "CLICK", 0) != EventJournal::none)
+            fail("testOutOfOrder", "appended to a full journal");
+        journal->done(pos[2]);
+        const uint64_t again{journal->append(chrono::system_clock::now(), "bid5", "1", "CLICK", 0)};
+        if (again != pos[2])
+            fail("testOutOfOrder", "the record freed last was not taken again");
+        string bidRequestId, impId, type;
+        journal->read(again, bidRequestId, impId, type);
+        if (bidRequestId != "bid5" || impId != "1" || type != "CLICK")
+            fail("testOutOfOrder", "read back " + bidRequestId + " " + impId + " " + type);
+    }
+    ::unlink(path.c_str());
+}
+
+// one event due far ahead must not keep the journal from taking the others
+void testDistantEvent() {
+    const string path{journalPath("distant")};
+    atomic<uint64_t> sent{0};
+    {
+        EventScheduler scheduler{1, 64, 1000, [&sent](const ScheduledEvent &) {
+                ++sent;
+            }, journalOf(path, 16)};
+        scheduler.schedule(chrono::seconds{3600}, "far", "1", "CONVERSION");
+        for (int round = 0; round < 20; ++round) {
+            for (int i = 0; i < 10; ++i) {
+                scheduler.schedule(chrono::milliseconds{1}, to_string(round) + "." + to_string(i), "1", "CLICK");
+            }
+            settle(scheduler, 1);
+        }
+        if (sent != 200 || scheduler.overflowed() != 0)
+            fail("testDistantEvent", to_string(sent) + " of 200 sent, " + to_string(scheduler.overflowed()) + " dropped");
+        if (scheduler.journal()->used() != 1)
+            fail("testDistantEvent", to_string(scheduler.journal()->used()) + " records in use instead of 1");
+        scheduler.stop();
+    }
+    ::unlink(path.c_str());
+}
+
+// beyond the memory budget events wait in the journal, and are all sent in
+// time
+void testSpill() {
+    const string path{journalPath("spill")};
+    const int count{20000};
+    atomic<uint64_t> sent{0};
+    atomic<int64_t> early{0};
+    atomic<int64_t> worst{0};
+    {
+        EventScheduler scheduler{1, count, 1000, [&](const ScheduledEvent & ev) {
+                const auto now = chrono::steady_clock::now();
+                // recalled events are due to the millisecond the journal keeps,
+                // give or take reading the clocks
+                if (ev.due > now + chrono::milliseconds{2})
+                    ++early;
+                const int64_t late{chrono::duration_cast<chrono::milliseconds> (now - ev.due).count()};
+                if (late > worst)
+                    worst = late;
+                ++sent;
+            }, journalOf(path, count)};
+        // all scheduled before the first is due
+        const auto start = chrono::steady_clock::now() + chrono::milliseconds{500};
+        for (int i = 0; i < count; ++i) {
+            scheduler.schedule(start + chrono::milliseconds{(i * 7919) % 500} - chrono::steady_clock::now(),
+                    to_string(i), "1", "CLICK");
+        }
+        settle(scheduler, 0);
+        if (sent != static_cast<uint64_t> (count))
+            fail("testSpill", to_string(sent) + " of " + to_string(count) + " sent");
+        if (scheduler.spilled() == 0 || scheduler.overflowed() != 0)
+            fail("testSpill", to_string(scheduler.spilled()) + " spilled, " + to_string(scheduler.overflowed()) + " dropped");
+        if (early != 0)
+            fail("testSpill", to_string(early) + " sent early");
+        if (worst > 200)
+            fail("testSpill", "sent up to " + to_string(worst) + " ms late");
+        if (scheduler.journal()->used() != 0)
+            fail("testSpill", to_string(scheduler.journal()->used()) + " records still in use");
+        scheduler.stop();
+    }
+    ::unlink(path.c_str());
+}
+
+// with memory and the journal full the event is dropped and counted
+void testFull() {
+    const string path{journalPath("full")};
+    {
+        EventScheduler scheduler{1, 1024, 16, [](const ScheduledEvent &) {
+            }, journalOf(path, 32)};
+        // each due before the last, so that the sender wakes up to take it
+        for (int i = 0; i < 100; ++i) {
+            scheduler.schedule(chrono::seconds{3600} - chrono::milliseconds{i}, to_string(i), "1", "CLICK");
+        }
+        const auto until = chrono::steady_clock::now() + chrono::seconds{10};
+        while (scheduler.depth() > 0 && chrono::steady_clock::now() < until) {
+            this_thread::sleep_for(chrono::milliseconds{5});
+        }
+        this_thread::sleep_for(chrono::milliseconds{50});
+        // 32 in the journal and the 16 due first in memory
+        if (scheduler.pending() != 48 || scheduler.overflowed() != 52)
+            fail("testFull", to_string(scheduler.pending()) + " waiting, " + to_string(scheduler.overflowed()) + " dropped");
+        scheduler.stop();
+    }
+    // and without a journal, beyond the memory budget
+    {
+        EventScheduler scheduler{1, 1024, 16, [](const ScheduledEvent &) {
+            }};
+        // each due before the last, so that the sender wakes up to take it
+        for (int i = 0; i < 100; ++i) {
+            scheduler.schedule(chrono::seconds{3600} - chrono::milliseconds{i}, to_string(i), "1", "CLICK");
+        }
+        const auto until = chrono::steady_clock::now() + chrono::seconds{10};
+        while (scheduler.depth() > 0 && chrono::steady_clock::now() < until) {
+            this_thread::sleep_for(chrono::milliseconds{5});
+        }
+        this_thread::sleep_for(chrono::milliseconds{50});
+        if (scheduler.pending() != 16 || scheduler.overflowed() != 84)
+            fail("testFull", "without a journal " + to_string(scheduler.pending()) + " waiting, "
+                + to_string(scheduler.overflowed()) + " dropped");
+        scheduler.stop();
+    }
+    ::unlink(path.c_str());
+}
+
+// events not sent, in memory or spilled, are picked up by the next run
+void testRestart() {
+    const string path{journalPath("restart")};
+    {
+        EventScheduler scheduler{2, 1024, 10, [](const ScheduledEvent &) {
+            }, journalOf(path, 1000)};
+        for (int i = 0; i < 500; ++i) {
+            scheduler.schedule(chrono::milliseconds{i < 250 ? 100 : 3600000}, to_string(i), "1", "CLICK");
+        }
+        this_thread::sleep_for(chrono::milliseconds{50});
+        scheduler.stop();
+    }
+    atomic<uint64_t> sent{0};
+    {
+        EventScheduler scheduler{3, 1024, 10, [&sent](const ScheduledEvent & ev) {
+                if (ev.type == "CLICK" && !ev.bidRequestId.empty())
+                    ++sent;
+            }, journalOf(path, 1000)};
+        if (scheduler.replayed() != 500)
+            fail("testRestart", to_string(scheduler.replayed()) + " of 500 picked up");
+        settle(scheduler, 250);
+        if (sent != 250)
+            fail("testRestart", to_string(sent) + " of the 250 due sent");
+        scheduler.stop();
+    }
+    ::unlink(path.c_str());
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    cout << "%SUITE_STARTING% event_journal_test" << endl;
+    cout << "%SUITE_STARTED%" << endl;
+
+    struct {
+        const char *name;
+        void (*test)();
+    } tests[]{
+        {"testOutOfOrder", testOutOfOrder},
+        {"testDistantEvent", testDistantEvent},
+        {"testSpill", testSpill},
+        {"testFull", testFull},
+        {"testRestart", testRestart}
+    };
+    for (auto &t : tests) {
+        cout << "%TEST_STARTED% " << t.name << " (event_journal_test)" << endl;
+        t.test();
+        cout << "%TEST_FINISHED% time=0 " << t.name << " (event_journal_test)" << endl;
+    }
+
+    cout << "%SUITE_FINISHED% time=0" << endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
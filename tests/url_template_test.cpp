@@ -0,0 +1,106 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of the notice URL templates and their per thread cache, in the
+// format of the NetBeans simple tests.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "url_template.h"
+
+using namespace std;
+
+namespace {
+
+int failures{0};
+
+void fail(const char *test, const string &message) {
+    cout << "%TEST_FAILED% time=0 testname=" << test << " (url_template_test) message=" << message << endl;
+    ++failures;
+}
+
+const AuctionMacros macros{"4c3e1f0a", "1", "2", "seat", "ad", "USD", "1.25", 2.0, 1.0, 0};
+
+// every macro filled in, unknown ones left as they are
+void testMacros() {
+    shared_ptr<const UrlTemplate> t{UrlTemplate::of("http://bidder:8080/win/${AUCTION_ID}/${AUCTION_IMP_ID}"
+            "?p=${AUCTION_PRICE}&bid=${AUCTION_BID_ID}&seat=${AUCTION_SEAT_ID}&ad=${AUCTION_AD_ID}"
+            "&cur=${AUCTION_CURRENCY}&mbr=${AUCTION_MBR}&loss=${AUCTION_LOSS}&x=${OTHER}")};
+    if (t->host() != "bidder" || t->port() != 8080)
+        fail("testMacros", "host " + t->host() + ":" + to_string(t->port()));
+    const string expected{"/win/4c3e1f0a/2?p=1.25&bid=1&seat=seat&ad=ad&cur=USD&mbr=0.500000&loss=0&x=${OTHER}"};
+    if (t->target(macros) != expected)
+        fail("testMacros", t->target(macros));
+
+    shared_ptr<const UrlTemplate> bare{UrlTemplate::of("http://bidder")};
+    if (bare->port() != 80 || bare->target(macros) != "/")
+        fail("testMacros", "bare host " + bare->target(macros));
+}
+
+// a URL that does not compile throws every time it is seen, not only the
+// first time
+void testBadUrl() {
+    int thrown{0};
+    for (int i = 0; i < 2; ++i) {
+        try {
+            UrlTemplate::of("http://bidder:port/win/${AUCTION_PRICE}");
+        } catch (const runtime_error &) {
+            ++thrown;
+        }
+    }
+    if (thrown != 2)
+        fail("testBadUrl", "thrown " + to_string(thrown) + " times out of 2");
+}
+
+// a template being used stays valid while the cache fills up and is cleared
+void testEviction() {
+    shared_ptr<const UrlTemplate> held{UrlTemplate::of("http://held:81/win/${AUCTION_ID}")};
+    for (int i = 0; i < 10000; ++i) {
+        UrlTemplate::of("http://bidder/win/" + to_string(i) + "/${AUCTION_ID}");
+    }
+    if (held->host() != "held" || held->port() != 81 || held->target(macros) != "/win/4c3e1f0a")
+        fail("testEviction", "held template changed to " + held->host() + held->target(macros));
+
+    shared_ptr<const UrlTemplate> again{UrlTemplate::of("http://held:81/win/${AUCTION_ID}")};
+    if (again->target(macros) != "/win/4c3e1f0a")
+        fail("testEviction", "compiled again to " + again->target(macros));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    cout << "%SUITE_STARTING% url_template_test" << endl;
+    cout << "%SUITE_STARTED%" << endl;
+
+    struct {
+        const char *name;
+        void (*test)();
+    } tests[]{
+        {"testMacros", testMacros},
+        {"testBadUrl", testBadUrl},
+        {"testEviction", testEviction}
+    };
+    for (auto &t : tests) {
+        cout << "%TEST_STARTED% " << t.name << " (url_template_test)" << endl;
+        t.test();
+        cout << "%TEST_FINISHED% time=0 " << t.name << " (url_template_test)" << endl;
+    }
+
+    cout << "%SUITE_FINISHED% time=0" << endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,134 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+
+// Hashed timing wheel. Scheduling is O(1) and advancing costs one slot per
+// tick plus the entries that fire. Deadlines further away than one turn of
+// the wheel stay in their slot until their turn comes around. Entries cannot
+// be cancelled, the owner ignores those that have become stale when they fire.
+// Each slot keeps the earliest deadline in it, and the wheel the earliest of
+// those, so finding the next one to wait for does not look at the entries.
+// Not thread safe.
+template <typename T>
+class TimerWheel {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    TimerWheel(Clock::duration tick, size_t nslots, Clock::time_point start = Clock::now())
+    : tick(tick), slots(nslots), slotEarliest(nslots, Clock::time_point::max()), origin(start), current{0}, pending{0},
+    earliest{Clock::time_point::max()}, earliestKnown{true}
+    {
+    }
+
+    void schedule(Clock::time_point when, const T &item) {
+        uint64_t t{tickOf(when)};
+        if (t < current)
+            t = current; // already due, fire on the next advance
+        slots[t % slots.size()].push_back(std::make_pair(when, item));
+        slotEarliest[t % slots.size()] = std::min(slotEarliest[t % slots.size()], when);
+        earliest = std::min(earliest, when);
+        ++pending;
+    }
+
+    // fire every entry due at or before now, in no particular order
+    template <typename F>
+    void advance(Clock::time_point now, F fire) {
+        uint64_t target{tickOf(now)};
+        if (target < current)
+            return;
+        uint64_t steps{target - current + 1};
+        if (steps > slots.size())
+            steps = slots.size(); // a full turn visits every slot
+        std::vector<std::pair<Clock::time_point, T>> due{};
+        for (uint64_t i = 0; i < steps; ++i) {
+            const size_t s{(current + i) % slots.size()};
+            auto &slot = slots[s];
+            if (slotEarliest[s] > now)
+                continue; // nothing in it is due yet
+            slotEarliest[s] = Clock::time_point::max();
+            for (size_t j = 0; j < slot.size();) {
+                if (slot[j].first <= now) {
+                    due.push_back(std::move(slot[j]));
+                    slot[j] = std::move(slot.back());
+                    slot.pop_back();
+                } else {
+                    slotEarliest[s] = std::min(slotEarliest[s], slot[j].first);
+                    ++j;
+                }
+            }
+        }
+        current = target;
+        pending -= due.size();
+        if (earliest <= now)
+            earliestKnown = false; // it has fired, the next one is looked up when asked for
+        for (auto &d : due) {
+            fire(d.second);
+        }
+    }
+
+    // the earliest deadline of any entry, time_point::max() if there is none:
+    // how long a caller may sleep without missing one
+    Clock::time_point nextDue() const {
+        if (!earliestKnown) {
+            earliest = *std::min_element(slotEarliest.begin(), slotEarliest.end());
+            earliestKnown = true;
+        }
+        return earliest;
+    }
+
+    bool empty() const {
+        return pending == 0;
+    }
+
+    // fire every entry, due or not, leaving the wheel empty
+    template <typename F>
+    void clear(F fire) {
+        std::vector<std::pair<Clock::time_point, T>> all{};
+        for (auto &slot : slots) {
+            for (auto &e : slot) {
+                all.push_back(std::move(e));
+            }
+            slot.clear();
+        }
+        std::fill(slotEarliest.begin(), slotEarliest.end(), Clock::time_point::max());
+        pending = 0;
+        earliest = Clock::time_point::max();
+        earliestKnown = true;
+        for (auto &e : all) {
+            fire(e.second);
+        }
+    }
+
+private:
+    uint64_t tickOf(Clock::time_point when) const {
+        if (when <= origin)
+            return 0;
+        return static_cast<uint64_t> ((when - origin) / tick);
+    }
+
+    const Clock::duration tick;
+    std::vector<std::vector<std::pair<Clock::time_point, T>>> slots;
+    std::vector<Clock::time_point> slotEarliest;    // earliest deadline in each slot
+    const Clock::time_point origin;
+    uint64_t current;   // tick the wheel has been advanced to
+    size_t pending;
+    mutable Clock::time_point earliest;     // of all entries, while earliestKnown
+    mutable bool earliestKnown;
+};
@@ -0,0 +1,521 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// The io_uring reactor. Every open connection keeps one receive queued with
+// the kernel, and the sends that dispatching produces are queued as well;
+// each turn of the loop then submits them all and collects the completions
+// with a single io_uring_enter call. Requests are copied into a per
+// connection send buffer and responses land in a per connection receive
+// buffer; both are registered with the kernel once, so it does not have to
+// map the pages on every operation. The ring is driven with the raw system
+// calls, liburing is not needed.
+
+#include "reactor.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+using namespace std;
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+const size_t bufferSize{16384};     // per connection and direction
+const chrono::milliseconds reconnectDelay{100};
+
+// what a completion is for: the connection index goes in the upper bits
+enum Op : uint64_t {
+    OpConnect = 1, OpSend, OpRecv, OpCancel, OpWake
+};
+
+uint64_t token(size_t idx, Op op) {
+    return static_cast<uint64_t> (idx) << 8 | op;
+}
+
+// A submission and a completion queue shared with the kernel
+class Ring {
+public:
+    explicit Ring(unsigned entries);
+    ~Ring();
+
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    // a cleared submission queue entry. If the queue is full what is in it
+    // is submitted first.
+    io_uring_sqe *next();
+
+    // submit what is queued and, if no completion is waiting, wait up to
+    // timeout for one
+    void enter(chrono::milliseconds timeout);
+
+    // hand each completion to f(user_data, res)
+    template <typename F>
+    void reap(F f) {
+        unsigned head{*cqHead};
+        const unsigned tail{__atomic_load_n(cqTail, __ATOMIC_ACQUIRE)};
+        while (head != tail) {
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            f(cqe.user_data, cqe.res);
+            ++head;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    int fd() const {
+        return ringfd;
+    }
+
+private:
+    void unmap();
+
+    int ringfd;
+    io_uring_params params;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqLocalTail;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+};
+
+int setup(unsigned entries, io_uring_params &params) {
+    return static_cast<int> (syscall(__NR_io_uring_setup, entries, &params));
+}
+
+Ring::Ring(unsigned entries) : params{}, sqRing{MAP_FAILED}, cqRing{MAP_FAILED}, sqes{nullptr}, sqLocalTail{0} {
+    ringfd = setup(entries, params);
+    if (ringfd < 0) {
+        throw runtime_error("Could not set up io_uring: " + string(strerror(errno)));
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqRing != MAP_FAILED) {
+        cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing
+                : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+    }
+    void *sqeMap{MAP_FAILED};
+    if (cqRing != MAP_FAILED) {
+        sqeMap = mmap(nullptr, params.sq_entries * sizeof (io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ringfd, IORING_OFF_SQES);
+    }
+    if (sqeMap == MAP_FAILED) {
+        string error{strerror(errno)};
+        unmap();
+        ::close(ringfd);
+        throw runtime_error("Could not map io_uring: " + error);
+    }
+    sqes = static_cast<io_uring_sqe *> (sqeMap);
+
+    char *sq{static_cast<char *> (sqRing)};
+    sqHead = reinterpret_cast<unsigned *> (sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned *> (sq + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned *> (sq + params.sq_off.ring_mask);
+    sqLocalTail = *sqTail;
+    // submission entry i always sits in slot i of the index array
+    unsigned *array{reinterpret_cast<unsigned *> (sq + params.sq_off.array)};
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    char *cq{static_cast<char *> (cqRing)};
+    cqHead = reinterpret_cast<unsigned *> (cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *> (cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned *> (cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *> (cq + params.cq_off.cqes);
+}
+
+Ring::~Ring() {
+    unmap();
+    ::close(ringfd);
+}
+
+void Ring::unmap() {
+    if (sqes != nullptr)
+        munmap(sqes, params.sq_entries * sizeof (io_uring_sqe));
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+}
+
+io_uring_sqe *Ring::next() {
+    if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= params.sq_entries) {
+        enter(chrono::milliseconds{0});
+    }
+    io_uring_sqe *sqe{&sqes[sqLocalTail & sqMask]};
+    memset(sqe, 0, sizeof (*sqe));
+    ++sqLocalTail;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+void Ring::enter(chrono::milliseconds timeout) {
+    const unsigned queued{sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)};
+    const bool idle{*cqHead == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)};
+    const unsigned wait{timeout.count() > 0 && idle ? 1u : 0u};
+
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = timeout.count() % 1000 * 1000000;
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t> (&ts);
+
+    // ETIME, EINTR and EBUSY (completion queue full) all just mean the
+    // caller should reap and come back
+    syscall(__NR_io_uring_enter, ringfd, queued, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+}
+
+// What the ring has going on one connection
+struct Slot {
+    int ops{0};             // operations the kernel has not completed yet
+    bool sending{false};
+    bool receiving{false};
+    int closing{-1};        // socket to close once ops is down to 0
+};
+
+class UringReactor : public Reactor {
+public:
+    UringReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections, const EngineOptions &options);
+    ~UringReactor();
+
+private:
+    void connect(Connection &c) override;
+    void release(Connection &c) override;
+    void flush(Connection &c) override;
+    void poll(chrono::milliseconds timeout) override;
+    void wake() override;
+
+    // a closed connection waits for the kernel to let go of its buffers
+    bool reusable(const Connection &c) const override {
+        return slots[indexOf(c)].ops == 0;
+    }
+
+    void armWake();
+    void armRecv(size_t idx);
+    void onCompletion(uint64_t data, int res);
+    void settle(Slot &s);
+
+    char *sendBuffer(size_t idx) {
+        return buffers + idx * bufferSize;
+    }
+
+    char *recvBuffer(size_t idx) {
+        return buffers + (conns.size() + idx) * bufferSize;
+    }
+
+    Ring ring;
+    int wakefd;
+    uint64_t wakeCount;
+    char *buffers;          // send buffers of all connections, then their receive buffers
+    size_t buffersSize;
+    bool registered;        // buffers are registered, use the fixed buffer operations
+    vector<Slot> slots;
+};
+
+unsigned ringEntries(int nconnections) {
+    unsigned n{1};
+    while (n < static_cast<unsigned> (nconnections) * 3 + 8) // connect or send and receive, a cancel, and the wake
+        n <<= 1;
+    return n;
+}
+
+UringReactor::UringReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections,
+        const EngineOptions &options)
+: Reactor(engine, addr, addrlen, nconnections, options), ring{ringEntries(nconnections)}, wakeCount{0},
+registered{false}, slots(nconnections)
+{
+    wakefd = eventfd(0, EFD_CLOEXEC); // blocking, the ring waits for it
+    buffersSize = 2 * bufferSize * conns.size();
+    void *mem = mmap(nullptr, buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (wakefd < 0 || mem == MAP_FAILED) {
+        if (wakefd >= 0)
+            ::close(wakefd);
+        throw runtime_error("Could not create io_uring reactor: " + string(strerror(errno)));
+    }
+    buffers = static_cast<char *> (mem);
+
+    // without registered buffers (e.g. over the locked memory limit) plain
+    // sends and receives on the same buffers do the job
+    iovec areas[2]{
+        {buffers, buffersSize / 2},
+        {buffers + buffersSize / 2, buffersSize / 2}};
+    registered = syscall(__NR_io_uring_register, ring.fd(), IORING_REGISTER_BUFFERS, areas, 2) == 0;
+
+    armWake();
+
+    // A write to a socket the peer has closed raises SIGPIPE, and the fixed
+    // buffer write has no MSG_NOSIGNAL. The reactor thread inherits this
+    // mask, so it gets EPIPE like the epoll reactor does.
+    sigset_t pipe{}, old{};
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, &old);
+    start();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+UringReactor::~UringReactor() {
+    stop();
+
+    // every socket has been shut down, so what the kernel still has on them
+    // completes promptly; the buffers must not go before that
+    for (int i = 0; i < 100; ++i) {
+        bool busy{false};
+        for (auto &s : slots) {
+            busy = busy || s.ops > 0;
+        }
+        if (!busy)
+            break;
+        poll(chrono::milliseconds{10});
+    }
+    for (auto &s : slots) {
+        if (s.closing >= 0)
+            ::close(s.closing);
+    }
+    ::close(wakefd);
+    munmap(buffers, buffersSize);
+}
+
+void UringReactor::wake() {
+    uint64_t one{1};
+    ssize_t r = write(wakefd, &one, sizeof (one));
+    (void) r;
+}
+
+void UringReactor::armWake() {
+    io_uring_sqe *sqe{ring.next()};
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakefd;
+    sqe->addr = reinterpret_cast<uint64_t> (&wakeCount);
+    sqe->len = sizeof (wakeCount);
+    sqe->user_data = token(0, OpWake);
+}
+
+void UringReactor::connect(Connection &c) {
+    c.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c.fd < 0) {
+        c.retryAt = Clock::now() + reconnectDelay;
+        return;
+    }
+    if (addr.ss_family != AF_UNIX) {
+        int one{1};
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    }
+
+    c.state = ConnState::Connecting;
+    const size_t idx{indexOf(c)};
+    io_uring_sqe *sqe{ring.next()};
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = c.fd;
+    sqe->addr = reinterpret_cast<uint64_t> (&addr);
+    sqe->off = addrlen;
+    sqe->user_data = token(idx, OpConnect);
+    ++slots[idx].ops;
+}
+
+// Shutting the socket down ends the pending receive; a connect in progress
+// is cancelled. Their completions come in later and are only counted. The
+// descriptor stays open until then, as entries not yet submitted refer to it
+// by number and a new socket must not take that number over.
+void UringReactor::release(Connection &c) {
+    if (c.fd < 0)
+        return;
+    const size_t idx{indexOf(c)};
+    if (c.state == ConnState::Connecting) {
+        io_uring_sqe *sqe{ring.next()};
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = token(idx, OpConnect);
+        sqe->user_data = token(idx, OpCancel);
+    }
+    shutdown(c.fd, SHUT_RDWR);
+    Slot &s = slots[idx];
+    s.sending = false;
+    s.receiving = false;
+    s.closing = c.fd;
+    settle(s);
+}
+
+void UringReactor::settle(Slot &s) {
+    if (s.ops == 0 && s.closing >= 0) {
+        ::close(s.closing);
+        s.closing = -1;
+    }
+}
+
+void UringReactor::flush(Connection &c) {
+    const size_t idx{indexOf(c)};
+    Slot &s = slots[idx];
+    if (s.sending || c.state != ConnState::Open || c.out.empty())
+        return;
+
+    // a fixed write goes from the registered buffer, so the pieces are
+    // gathered there
+    size_t n{0};
+    for (auto it = c.out.begin(); it != c.out.end() && n < bufferSize; ++it) {
+        const size_t len{min(it->iov_len, bufferSize - n)};
+        memcpy(sendBuffer(idx) + n, it->iov_base, len);
+        n += len;
+    }
+    io_uring_sqe *sqe{ring.next()};
+    if (registered) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->fd = c.fd;
+    sqe->addr = reinterpret_cast<uint64_t> (sendBuffer(idx));
+    sqe->len = static_cast<uint32_t> (n);
+    sqe->user_data = token(idx, OpSend);
+    s.sending = true;
+    ++s.ops;
+}
+
+void UringReactor::armRecv(size_t idx) {
+    Slot &s = slots[idx];
+    io_uring_sqe *sqe{ring.next()};
+    if (registered) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = 1;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->fd = conns[idx].fd;
+    sqe->addr = reinterpret_cast<uint64_t> (recvBuffer(idx));
+    sqe->len = static_cast<uint32_t> (bufferSize);
+    sqe->user_data = token(idx, OpRecv);
+    s.receiving = true;
+    ++s.ops;
+}
+
+void UringReactor::onCompletion(uint64_t data, int res) {
+    const Op op{static_cast<Op> (data & 0xff)};
+    if (op == OpWake) {
+        armWake();
+        return;
+    }
+    if (op == OpCancel)
+        return;
+
+    const size_t idx{static_cast<size_t> (data >> 8)};
+    Connection &c = conns[idx];
+    Slot &s = slots[idx];
+    --s.ops;
+    if (c.state == ConnState::Closed) {
+        settle(s); // the connection went while this was under way
+        return;
+    }
+
+    switch (op) {
+        case OpConnect:
+            if (res < 0) {
+                close(c);
+                return;
+            }
+            opened(idx);
+            armRecv(idx);
+            break;
+        case OpSend:
+            s.sending = false;
+            if (res < 0) {
+                close(c);
+                return;
+            }
+            written(c, static_cast<size_t> (res));
+            flush(c);
+            break;
+        case OpRecv:
+            s.receiving = false;
+            if (res > 0)
+                c.in.append(recvBuffer(idx), static_cast<size_t> (res));
+            // 0 or an error: the peer has gone, complete what has arrived
+            received(idx, res <= 0);
+            if (c.state == ConnState::Open && !s.receiving)
+                armRecv(idx);
+            break;
+        default:
+            break;
+    }
+}
+
+void UringReactor::poll(chrono::milliseconds timeout) {
+    ring.enter(timeout);
+    ring.reap([this](uint64_t data, int res) {
+        onCompletion(data, res);
+    });
+}
+
+} // namespace
+
+bool uringAvailable() {
+    static const bool available = [] {
+        io_uring_params params{};
+        int fd{setup(4, params)};
+        if (fd < 0)
+            return false;
+        ::close(fd);
+        return (params.features & IORING_FEAT_EXT_ARG) != 0; // waiting with a timeout, kernel 5.11
+    }();
+    return available;
+}
+
+Reactor *newUringReactor(HttpEngine &engine, const sockaddr_storage &addr, socklen_t addrlen, int nconnections,
+        const EngineOptions &options) {
+    return new UringReactor(engine, addr, addrlen, nconnections, options);
+}
+
+#else
+
+bool uringAvailable() {
+    return false;
+}
+
+Reactor *newUringReactor(HttpEngine &, const sockaddr_storage &, socklen_t, int, const EngineOptions &) {
+    throw runtime_error("Built without io_uring support");
+}
+
+#endif
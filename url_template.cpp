@@ -0,0 +1,143 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "url_template.h"
+
+#include <unordered_map>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+// bidders that put a different URL in every bid would only fill the cache.
+// Clearing it lets go of the templates no one is holding any more.
+const size_t maxCached{4096};
+
+}
+
+UrlTemplate::Macro UrlTemplate::macroOf(const string &name) {
+    static const unordered_map<string, Macro> macros{
+        {"AUCTION_ID", Macro::AuctionId},
+        {"AUCTION_BID_ID", Macro::BidId},
+        {"AUCTION_IMP_ID", Macro::ImpId},
+        {"AUCTION_SEAT_ID", Macro::SeatId},
+        {"AUCTION_AD_ID", Macro::AdId},
+        {"AUCTION_PRICE", Macro::Price},
+        {"AUCTION_CURRENCY", Macro::Currency},
+        {"AUCTION_MBR", Macro::MarketBidRatio},
+        {"AUCTION_LOSS", Macro::Loss}
+    };
+    auto it = macros.find(name);
+    return it == macros.end() ? Macro::None : it->second;
+}
+
+UrlTemplate::UrlTemplate(const string &url)
+: portNumber{80}, literals{0}
+{
+    // scheme://host[:port] and then the path and query, which may be left out
+    size_t start{url.find("://")};
+    start = start == string::npos ? 0 : start + 3;
+    size_t end{url.find_first_of("/?", start)};
+    if (end == string::npos)
+        end = url.length();
+    hostName = url.substr(start, end - start);
+    const size_t colon{hostName.rfind(':')};
+    if (colon != string::npos && hostName.find(']', colon) == string::npos) {
+        try {
+            portNumber = static_cast<unsigned short> (stoi(hostName.substr(colon + 1)));
+        } catch (const logic_error &) {
+            throw runtime_error("Bad port in notice URL: " + url);
+        }
+        hostName.erase(colon);
+    }
+
+    string rest{url.substr(end)};
+    if (rest.empty() || rest[0] == '?')
+        rest.insert(0, "/");
+
+    Piece literal{Macro::None, ""};
+    size_t pos{0};
+    while (pos < rest.length()) {
+        const size_t open{rest.find("${", pos)};
+        const size_t close{open == string::npos ? string::npos : rest.find('}', open + 2)};
+        if (close == string::npos) {
+            literal.text.append(rest, pos, string::npos);
+            break;
+        }
+        const Macro macro{macroOf(rest.substr(open + 2, close - open - 2))};
+        if (macro == Macro::None) {
+            literal.text.append(rest, pos, close + 1 - pos);
+        } else {
+            literal.text.append(rest, pos, open - pos);
+            if (!literal.text.empty()) {
+                literals += literal.text.length();
+                pieces.push_back(std::move(literal));
+                literal = Piece{Macro::None, ""};
+            }
+            pieces.push_back(Piece{macro, ""});
+        }
+        pos = close + 1;
+    }
+    if (!literal.text.empty()) {
+        literals += literal.text.length();
+        pieces.push_back(std::move(literal));
+    }
+}
+
+shared_ptr<const UrlTemplate> UrlTemplate::of(const string &url) {
+    thread_local unordered_map<string, shared_ptr<const UrlTemplate>> cache{};
+    auto it = cache.find(url);
+    if (it != cache.end())
+        return it->second;
+
+    // only once it compiled, a URL that throws is tried again next time
+    shared_ptr<const UrlTemplate> t{make_shared<UrlTemplate>(url)};
+    if (cache.size() >= maxCached)
+        cache.clear();
+    cache.emplace(url, t);
+    return t;
+}
+
+string UrlTemplate::target(const AuctionMacros &values) const {
+    string out{};
+    out.reserve(literals + 128);
+    for (auto &p : pieces) {
+        switch (p.macro) {
+            case Macro::None: out += p.text;
+                break;
+            case Macro::AuctionId: out += values.auctionId;
+                break;
+            case Macro::BidId: out += values.bidId;
+                break;
+            case Macro::ImpId: out += values.impId;
+                break;
+            case Macro::SeatId: out += values.seatId;
+                break;
+            case Macro::AdId: out += values.adId;
+                break;
+            case Macro::Price: out += values.price;
+                break;
+            case Macro::Currency: out += values.currency;
+                break;
+            case Macro::MarketBidRatio:
+                if (values.bidPrice > 0.0)
+                    out += to_string(values.clearingPrice / values.bidPrice);
+                break;
+            case Macro::Loss: out += to_string(values.loss);
+                break;
+        }
+    }
+    return out;
+}
@@ -0,0 +1,79 @@
+//   Copyright 2016 Mats Brorsson, OLA Mobile S.a.r.l
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Notice URLs as bidders send them in a bid's nurl (and lurl and burl), with
+// the OpenRTB substitution macros such as ${AUCTION_PRICE} anywhere in their
+// path or query. A URL is compiled once into the literal text and the macros
+// it is made of, so that filling it in for a notice is a single pass that
+// appends each piece in turn. Bidders tend to send the same few URLs, with the
+// ids left to the macros, so the compiled templates are kept per thread.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// what the macros of one bid expand to
+struct AuctionMacros {
+    std::string auctionId;  // id of the bid request
+    std::string bidId;
+    std::string impId;
+    std::string seatId;
+    std::string adId;
+    std::string currency;
+    std::string price;      // clearing price, as it is to appear in the URL
+    double bidPrice;        // for the market bid ratio
+    double clearingPrice;
+    int loss;               // OpenRTB loss reason code, 0 if the bid won
+};
+
+class UrlTemplate {
+public:
+    explicit UrlTemplate(const std::string &url);
+
+    // the template of url, compiled the first time this thread sees it. It
+    // stays valid however many other URLs the thread goes on to see.
+    static std::shared_ptr<const UrlTemplate> of(const std::string &url);
+
+    // where the notice goes, port 80 unless the URL gives one
+    const std::string &host() const {
+        return hostName;
+    }
+
+    unsigned short port() const {
+        return portNumber;
+    }
+
+    // the path and query, with the macros filled in. Unknown macros are left
+    // as they are.
+    std::string target(const AuctionMacros &values) const;
+
+private:
+    enum class Macro {
+        None, AuctionId, BidId, ImpId, SeatId, AdId, Price, Currency, MarketBidRatio, Loss
+    };
+
+    struct Piece {
+        Macro macro;
+        std::string text;   // with Macro::None
+    };
+
+    static Macro macroOf(const std::string &name);
+
+    std::string hostName;
+    unsigned short portNumber;
+    std::vector<Piece> pieces;
+    size_t literals;        // length of the literal text
+};